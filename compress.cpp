@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "compress.hpp"
+
+int compression_level = -1;
+
+struct compressor {
+	z_stream stream;
+	bool gzip;
+	std::vector<unsigned char> out;
+	size_t used;  // of out
+
+	compressor(bool gzip_)
+	    : gzip(gzip_), used(0) {
+		memset(&stream, 0, sizeof(stream));
+		stream.zalloc = Z_NULL;
+		stream.zfree = Z_NULL;
+		stream.opaque = Z_NULL;
+
+		// 31 for a gzip header, 15 for zlib
+		if (deflateInit2(&stream, tile_compression_level(gzip ? Z_BEST_COMPRESSION : Z_DEFAULT_COMPRESSION), Z_DEFLATED, gzip ? 31 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			fprintf(stderr, "Couldn't set up compression: %s\n", stream.msg);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	~compressor() {
+		deflateEnd(&stream);
+	}
+};
+
+static std::vector<compressor *> idle_compressors;
+static pthread_mutex_t compressor_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static compressor *take_compressor(bool gzip) {
+	compressor *c = NULL;
+
+	pthread_mutex_lock(&compressor_lock);
+	for (size_t i = idle_compressors.size(); i > 0; i--) {
+		if (idle_compressors[i - 1]->gzip == gzip) {
+			c = idle_compressors[i - 1];
+			idle_compressors.erase(idle_compressors.begin() + i - 1);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&compressor_lock);
+
+	if (c == NULL) {
+		c = new compressor(gzip);
+	}
+	return c;
+}
+
+static void give_back_compressor(compressor *c) {
+	pthread_mutex_lock(&compressor_lock);
+	idle_compressors.push_back(c);
+	pthread_mutex_unlock(&compressor_lock);
+}
+
+int tile_compression_level(int default_level) {
+	if (compression_level < 0) {
+		return default_level;
+	}
+	return compression_level;
+}
+
+compressor *start_compression(bool gzip) {
+	compressor *c = take_compressor(gzip);
+
+	if (deflateReset(&c->stream) != Z_OK) {
+		fprintf(stderr, "Couldn't reset compression: %s\n", c->stream.msg);
+		exit(EXIT_FAILURE);
+	}
+
+	c->used = 0;
+	return c;
+}
+
+static void run_deflate(compressor *c, const void *data, size_t len, int flush) {
+	c->stream.next_in = (Bytef *) data;
+	c->stream.avail_in = len;
+
+	while (true) {
+		if (c->used == c->out.size()) {
+			c->out.resize(std::max((size_t) 4096, 2 * c->out.size()));
+		}
+
+		c->stream.next_out = c->out.data() + c->used;
+		c->stream.avail_out = c->out.size() - c->used;
+
+		int ret = deflate(&c->stream, flush);
+		c->used = c->out.size() - c->stream.avail_out;
+
+		if (ret == Z_STREAM_END) {
+			break;
+		}
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			fprintf(stderr, "Couldn't compress tile: %s\n", c->stream.msg);
+			exit(EXIT_FAILURE);
+		}
+		if (flush == Z_NO_FLUSH && c->stream.avail_in == 0) {
+			break;
+		}
+	}
+}
+
+void compress_more(compressor *c, const void *data, size_t len) {
+	run_deflate(c, data, len, Z_NO_FLUSH);
+}
+
+void finish_compression(compressor *c, std::string &output) {
+	run_deflate(c, NULL, 0, Z_FINISH);
+	output.append((char *) c->out.data(), c->used);
+	give_back_compressor(c);
+}
+
+void compress_tile(std::string const &input, std::string &output, bool gzip) {
+	compressor *c = start_compression(gzip);
+
+	// deflateBound() leaves room for the gzip header and trailer too,
+	// so the whole tile is always compressed in one call.
+	size_t bound = deflateBound(&c->stream, input.size());
+	if (c->out.size() < bound) {
+		c->out.resize(bound);
+	}
+
+	run_deflate(c, input.data(), input.size(), Z_FINISH);
+	output.assign((char *) c->out.data(), c->used);
+	give_back_compressor(c);
+}
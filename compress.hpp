@@ -0,0 +1,21 @@
+// Deflate streams for compressing tiles, each made once and then reset for
+// every tile instead of being set up again, with an output buffer that stays
+// allocated between tiles. Each thread takes a stream from the pool while it
+// compresses a tile, so there are only ever as many as there are threads.
+
+// -1 for each format's own default: the best compression for vector tiles
+// and zlib's default for PNGs
+extern int compression_level;
+
+// Compress input, as gzip or with a zlib header, into output
+void compress_tile(std::string const &input, std::string &output, bool gzip);
+
+// Or, to compress a tile a piece at a time, start, add each piece,
+// and finish, which appends the compressed data to output.
+struct compressor;
+compressor *start_compression(bool gzip);
+void compress_more(compressor *c, const void *data, size_t len);
+void finish_compression(compressor *c, std::string &output);
+
+// The level to use for a format whose default is default_level
+int tile_compression_level(int default_level);
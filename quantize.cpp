@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <limits.h>
+#include <vector>
+#include "quantize.hpp"
+
+// The AVX2 kernel is always compiled on x86-64, and used if the CPU has it
+#if defined(__x86_64__) && defined(__GNUC__)
+#define QUANTIZE_AVX2
+#include <immintrin.h>
+#endif
+
+// Tables for more levels than this would cost more to make than they save
+#define MAX_TABLE_LEVELS 65536
+
+// The levels that a PNG can hold
+#define MIN_COUNT_TABLE 256
+
+static long long level_of(long long count, int levels, double gamma, long long zoom_max) {
+	return exp(log(exp(log(levels) * gamma) * count / zoom_max) / gamma);
+}
+
+static long long count_of(long long level, int levels, double gamma, long long zoom_max) {
+	return ceil(exp(log(level) * gamma) * zoom_max / exp(log(levels) * gamma));
+}
+
+quantizer::quantizer()
+    : levels(0), gamma(0), zoom_max(0), top(0) {
+}
+
+quantizer::quantizer(int levels_, double gamma_, long long zoom_max_, int first_level)
+    : levels(levels_), gamma(gamma_), zoom_max(zoom_max_) {
+	top = levels - 1;
+	if (first_level > top) {
+		top = first_level;
+	}
+
+	size_t n = levels;
+	if (n < MIN_COUNT_TABLE) {
+		n = MIN_COUNT_TABLE;
+	}
+	counts.resize(n);
+	for (size_t i = 0; i < n; i++) {
+		counts[i] = count_of(i, levels, gamma, zoom_max);
+	}
+
+	if (zoom_max <= 0 || top < 0 || top >= MAX_TABLE_LEVELS) {
+		return;
+	}
+
+	size_t size = 1;
+	while (size < (size_t) top + 1) {
+		size *= 2;
+	}
+	bounds.resize(size, LLONG_MAX);
+	bounds[0] = 0;
+
+	// The level only ever goes up with the count, so the bound for each
+	// level is where a binary search finds the formula reaching it.
+	long long lo = 0;  // below the bound
+	for (int i = 1; i <= top; i++) {
+		long long step = 1;
+		long long hi = lo + step;
+		while (level_of(hi, levels, gamma, zoom_max) < i) {
+			lo = hi;
+			if (step > LLONG_MAX / 8 || hi > LLONG_MAX / 4) {
+				hi = LLONG_MAX;
+				break;
+			}
+			step *= 2;
+			hi = lo + step;
+		}
+		if (hi == LLONG_MAX) {
+			// never reached; neither are the levels above it
+			break;
+		}
+
+		while (hi - lo > 1) {
+			long long mid = lo + (hi - lo) / 2;
+			if (level_of(mid, levels, gamma, zoom_max) >= i) {
+				hi = mid;
+			} else {
+				lo = mid;
+			}
+		}
+
+		bounds[i] = hi;
+		lo = hi - 1;
+	}
+}
+
+bool quantizer::matches(int levels_, double gamma_, long long zoom_max_) const {
+	return levels == levels_ && gamma == gamma_ && zoom_max == zoom_max_;
+}
+
+long long quantizer::level(long long count) const {
+	if (count <= 0) {
+		return 0;
+	}
+	if (bounds.size() == 0) {
+		return level_of(count, levels, gamma, zoom_max);
+	}
+
+	size_t at = 0;
+	for (size_t step = bounds.size() / 2; step > 0; step /= 2) {
+		at += (bounds[at + step] <= count) ? step : 0;
+	}
+	return at;
+}
+
+long long quantizer::count(long long lev) const {
+	if (lev >= 0 && (size_t) lev < counts.size()) {
+		return counts[lev];
+	}
+	return count_of(lev, levels, gamma, zoom_max);
+}
+
+#ifdef QUANTIZE_AVX2
+// The same as the loop in quantize(), four pixels at a time, for as many
+// whole groups of four as there are. Returns how many pixels it did.
+__attribute__((target("avx2"))) static size_t quantize_avx2(quantizer const &q, long long const *raw, long long *counts, long long *normalized, size_t n, long long min_count, long long first_level, size_t &drawn) {
+	size_t i = 0;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i vmin = _mm256_set1_epi64x(min_count);
+	const __m256i vfirst = _mm256_set1_epi64x(first_level);
+	const __m256i vlast = _mm256_set1_epi64x(q.levels - 1);
+	long long const *bounds = q.bounds.data();
+
+	for (; i + 4 <= n; i += 4) {
+		__m256i c = _mm256_loadu_si256((__m256i const *) (raw + i));
+		__m256i positive = _mm256_cmpgt_epi64(c, zero);
+		c = _mm256_andnot_si256(_mm256_and_si256(positive, _mm256_cmpgt_epi64(vmin, c)), c);
+
+		// the same search as quantizer::level()
+		__m256i at = zero;
+		for (size_t step = q.bounds.size() / 2; step > 0; step /= 2) {
+			__m256i vstep = _mm256_set1_epi64x(step);
+			__m256i probe = _mm256_i64gather_epi64(bounds, _mm256_add_epi64(at, vstep), 8);
+			at = _mm256_add_epi64(at, _mm256_andnot_si256(_mm256_cmpgt_epi64(probe, c), vstep));
+		}
+
+		__m256i drop = _mm256_and_si256(_mm256_cmpgt_epi64(c, zero), _mm256_cmpgt_epi64(vfirst, at));
+		c = _mm256_andnot_si256(drop, c);
+		at = _mm256_andnot_si256(drop, at);
+		at = _mm256_blendv_epi8(at, vlast, _mm256_cmpgt_epi64(at, vlast));
+
+		_mm256_storeu_si256((__m256i *) (counts + i), c);
+		_mm256_storeu_si256((__m256i *) (normalized + i), at);
+		drawn += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(at, zero))));
+	}
+
+	return i;
+}
+#endif
+
+size_t quantize(quantizer const &q, long long const *raw, long long *counts, long long *normalized, size_t n, long long min_count, long long first_level) {
+	size_t drawn = 0;
+	size_t i = 0;
+
+#ifdef QUANTIZE_AVX2
+	if (q.bounds.size() > 0 && __builtin_cpu_supports("avx2")) {
+		i = quantize_avx2(q, raw, counts, normalized, n, min_count, first_level, drawn);
+	}
+#endif
+
+	for (; i < n; i++) {
+		long long count = raw[i];
+		long long density = 0;
+
+		if (count > 0 && count < min_count) {
+			count = 0;
+		}
+
+		if (count > 0) {
+			density = q.level(count);
+
+			if (density < first_level) {
+				density = 0;
+				count = 0;
+			}
+		}
+		if (density > q.levels - 1) {
+			density = q.levels - 1;
+		}
+
+		counts[i] = count;
+		normalized[i] = density;
+		if (density > 0) {
+			drawn++;
+		}
+	}
+
+	return drawn;
+}
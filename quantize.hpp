@@ -0,0 +1,44 @@
+// Conversion between pixel counts and density levels. The level of a count is
+//
+//     exp(log(exp(log(levels) * gamma) * count / zoom_max) / gamma)
+//
+// rounded down, and going back from a level to a count is
+//
+//     ceil(exp(log(level) * gamma) * zoom_max / exp(log(levels) * gamma))
+//
+// Both only depend on the count or level once levels, gamma, and zoom_max are
+// known, so a quantizer works them out once, as tables, instead of for every pixel.
+
+struct quantizer {
+	int levels;
+	double gamma;
+	long long zoom_max;
+	int top;  // the highest level that the table distinguishes
+
+	// bounds[i] is the smallest count at level i or above, padded to a
+	// power of 2 with counts that are never reached. Empty if the formula
+	// has to be used instead.
+	std::vector<long long> bounds;
+
+	// The count for each level, going back
+	std::vector<long long> counts;
+
+	quantizer();
+
+	// Levels are told apart up to first_level even if it is above the top level,
+	// since pixels below first_level are dropped before the level is clamped.
+	quantizer(int levels, double gamma, long long zoom_max, int first_level);
+
+	bool matches(int levels, double gamma, long long zoom_max) const;
+
+	// The level of a count, not clamped to levels - 1
+	long long level(long long count) const;
+
+	// The count that a level came from
+	long long count(long long level) const;
+};
+
+// Counts below min_count are set to 0. The others are given their level in
+// normalized, and those below first_level are set to 0 too. Levels are clamped
+// to levels - 1. Returns the number of pixels with a level above 0.
+size_t quantize(quantizer const &q, long long const *raw, long long *counts, long long *normalized, size_t n, long long min_count, long long first_level);
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <vector>
+#include <algorithm>
+#include "scan.hpp"
+
+// How much of the file each span covers, and how far ahead of it
+// the kernel is asked to read
+#define SCAN_WINDOW (4 * 1024 * 1024)
+
+static size_t page_size() {
+	static size_t size = sysconf(_SC_PAGESIZE);
+	return size;
+}
+
+static size_t page_floor(size_t off) {
+	return off - off % page_size();
+}
+
+static size_t page_ceil(size_t off) {
+	return page_floor(off + page_size() - 1);
+}
+
+// Advice is only a hint, so failures are ignored
+static void advise(record_file *f, size_t start, size_t end, int advice) {
+	start = page_floor(start);
+	if (f->map != NULL && end > start) {
+		madvise(f->map + start, end - start, advice);
+	}
+}
+
+record_file *open_records(const char *fname, size_t header_bytes, size_t record_bytes) {
+	record_file *f = new record_file;
+	f->header_bytes = header_bytes;
+	f->record_bytes = record_bytes;
+
+	f->fd = open(fname, O_RDONLY);
+	if (f->fd < 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(f->fd, &st) != 0) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+	f->size = st.st_size;
+
+	f->map = NULL;
+	if (f->size > 0) {
+		void *map = mmap(NULL, f->size, PROT_READ, MAP_SHARED, f->fd, 0);
+		if (map != MAP_FAILED) {
+			f->map = (unsigned char *) map;
+		}
+	}
+
+	return f;
+}
+
+void close_records(record_file *f) {
+	if (f->map != NULL && munmap(f->map, f->size) != 0) {
+		perror("munmap");
+		exit(EXIT_FAILURE);
+	}
+	if (close(f->fd) != 0) {
+		perror("close");
+		exit(EXIT_FAILURE);
+	}
+	delete f;
+}
+
+size_t count_records(record_file const *f) {
+	if (f->size < f->header_bytes) {
+		return 0;
+	}
+	return (f->size - f->header_bytes) / f->record_bytes;
+}
+
+void read_bytes(record_file *f, size_t off, size_t len, unsigned char *buf) {
+	if (off + len > f->size) {
+		fprintf(stderr, "Unexpected end of file reading %zu bytes at %zu\n", len, off);
+		exit(EXIT_FAILURE);
+	}
+
+	if (f->map != NULL) {
+		memcpy(buf, f->map + off, len);
+		return;
+	}
+
+	while (len > 0) {
+		ssize_t n = pread(f->fd, buf, len, off);
+		if (n < 0) {
+			perror("pread");
+			exit(EXIT_FAILURE);
+		}
+		if (n == 0) {
+			fprintf(stderr, "Unexpected end of file reading %zu bytes at %zu\n", len, off);
+			exit(EXIT_FAILURE);
+		}
+
+		buf += n;
+		off += n;
+		len -= n;
+	}
+}
+
+void scan_start(record_scan &s, record_file *f, size_t start, size_t end) {
+	s.file = f;
+	s.next = start;
+	s.end = end;
+
+	size_t from = f->header_bytes + start * f->record_bytes;
+	size_t to = f->header_bytes + end * f->record_bytes;
+	s.ahead = from;
+	s.behind = page_ceil(from);  // the page before may be another scan's
+
+	if (f->map != NULL) {
+		advise(f, from, to, MADV_SEQUENTIAL);
+	} else {
+		posix_fadvise(f->fd, from, to - from, POSIX_FADV_SEQUENTIAL);
+	}
+}
+
+size_t scan_next(record_scan &s, unsigned char **records) {
+	record_file *f = s.file;
+	size_t per_span = std::max((size_t) 1, SCAN_WINDOW / f->record_bytes);
+
+	if (s.next >= s.end) {
+		return 0;
+	}
+	size_t n = std::min(per_span, s.end - s.next);
+	size_t off = f->header_bytes + s.next * f->record_bytes;
+	s.next += n;
+
+	if (f->map == NULL) {
+		s.buf.resize(n * f->record_bytes);
+		read_bytes(f, off, n * f->record_bytes, s.buf.data());
+		*records = s.buf.data();
+		return n;
+	}
+
+	if (off + n * f->record_bytes > f->size) {
+		fprintf(stderr, "Unexpected end of file reading records at %zu\n", off);
+		exit(EXIT_FAILURE);
+	}
+	*records = f->map + off;
+
+	// Ask for the window after this span, and let go of the whole pages
+	// before it, which this scan is done with
+
+	size_t end = f->header_bytes + s.end * f->record_bytes;
+	size_t want = std::min(end, off + n * f->record_bytes + SCAN_WINDOW);
+	if (want > s.ahead) {
+		advise(f, s.ahead, want, MADV_WILLNEED);
+		s.ahead = want;
+	}
+
+	if (page_floor(off) > s.behind) {
+		advise(f, s.behind, page_floor(off), MADV_DONTNEED);
+		s.behind = page_floor(off);
+	}
+
+	return n;
+}
+
+void scan_finish(record_scan &s) {
+	record_file *f = s.file;
+	size_t end = page_floor(f->header_bytes + s.end * f->record_bytes);
+
+	if (end > s.behind) {
+		advise(f, s.behind, end, MADV_DONTNEED);
+		s.behind = end;
+	}
+}
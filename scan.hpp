@@ -0,0 +1,42 @@
+// Reading the records of a .count file, a range at a time, in order. The file
+// is mapped into memory if it can be, so that the records are used where they
+// are instead of being copied out one at a time, and the kernel is told to read
+// ahead of each scan and that it can let go of what is behind it. Files that
+// can't be mapped are read with pread() into a buffer instead.
+
+struct record_file {
+	int fd;
+	unsigned char *map;  // the whole file, or NULL to use pread()
+	size_t size;
+	size_t header_bytes;  // before the first record
+	size_t record_bytes;
+};
+
+// Exits if the file can't be opened
+record_file *open_records(const char *fname, size_t header_bytes, size_t record_bytes);
+void close_records(record_file *f);
+
+// The number of whole records in the file
+size_t count_records(record_file const *f);
+
+// Copy len bytes from offset off in the file into buf.
+// Exits if they aren't all there.
+void read_bytes(record_file *f, size_t off, size_t len, unsigned char *buf);
+
+struct record_scan {
+	record_file *file;
+	size_t next;    // the next record
+	size_t end;     // past the last record
+	size_t ahead;   // the file has been asked for up to this offset
+	size_t behind;  // and let go of up to this one
+	std::vector<unsigned char> buf;  // for pread()
+};
+
+// Scan records start up to end
+void scan_start(record_scan &s, record_file *f, size_t start, size_t end);
+
+// Point records at the next span of records in the range and return how
+// many there are, or 0 at the end. They are only there until the next call.
+size_t scan_next(record_scan &s, unsigned char **records);
+
+void scan_finish(record_scan &s);
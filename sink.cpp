@@ -0,0 +1,578 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include "sink.hpp"
+#include "serial.hpp"
+#include "tippecanoe/mbtiles.hpp"
+
+// Commit a transaction after this many tiles or bytes
+#define WRITE_BATCH_TILES 10000
+#define WRITE_BATCH_BYTES (128 * 1024 * 1024)
+
+static void sql_exec(sqlite3 *db, const char *sql) {
+	char *err = NULL;
+
+	if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s\n", sql, err);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void json_quote(std::string &out, std::string const &s) {
+	out.push_back('"');
+
+	for (size_t i = 0; i < s.size(); i++) {
+		unsigned char ch = s[i];
+
+		if (ch == '\\' || ch == '"') {
+			out.push_back('\\');
+			out.push_back(ch);
+		} else if (ch < ' ') {
+			char buf[7];
+			snprintf(buf, sizeof(buf), "\\u%04x", ch);
+			out.append(buf);
+		} else {
+			out.push_back(ch);
+		}
+	}
+
+	out.push_back('"');
+}
+
+// The metadata as a JSON object of strings, as in tippecanoe's metadata.json
+static std::string metadata_json(std::vector<std::pair<std::string, std::string>> const &metadata) {
+	std::string out = "{\n";
+
+	for (size_t i = 0; i < metadata.size(); i++) {
+		out.append("\t");
+		json_quote(out, metadata[i].first);
+		out.append(": ");
+		json_quote(out, metadata[i].second);
+		if (i + 1 < metadata.size()) {
+			out.append(",");
+		}
+		out.append("\n");
+	}
+
+	out.append("}\n");
+	return out;
+}
+
+// Two unrelated 64-bit hashes of the data, so that the chance of two
+// different tiles in a tileset having the same ID is negligible
+
+std::string tile_id(std::string const &data) {
+	unsigned long long fnv = 14695981039346656037ULL;
+	for (size_t i = 0; i < data.size(); i++) {
+		fnv ^= (unsigned char) data[i];
+		fnv *= 1099511628211ULL;
+	}
+
+	unsigned long long h = std::hash<std::string>()(data);
+
+	char buf[33];
+	snprintf(buf, sizeof(buf), "%016llx%016llx", fnv, h);
+	return buf;
+}
+
+std::vector<std::pair<std::string, std::string>> read_metadata(sqlite3 *db) {
+	std::vector<std::pair<std::string, std::string>> out;
+
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(db, "SELECT name, value from metadata order by rowid;", -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "read metadata: %s\n", sqlite3_errmsg(db));
+		exit(EXIT_FAILURE);
+	}
+
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		const char *name = (const char *) sqlite3_column_text(stmt, 0);
+		const char *value = (const char *) sqlite3_column_text(stmt, 1);
+
+		out.push_back(std::pair<std::string, std::string>(name == NULL ? "" : name, value == NULL ? "" : value));
+	}
+
+	sqlite3_finalize(stmt);
+	return out;
+}
+
+// MBTiles: with more than one writer, each writes its own shard database,
+// and the shards are copied into the output in index order when it is closed.
+// With dedup, each image is written the first time its ID is seen.
+
+struct mbtiles_sink : tile_sink {
+	std::string name;
+	char **argv;
+	sqlite3 *db;
+	sqlite3_stmt *stmt = NULL;
+	sqlite3_stmt *image_stmt = NULL;
+	size_t batch_tiles = 0;
+	size_t batch_bytes = 0;
+	std::vector<mbtiles_sink *> shards;
+
+	bool dedup;
+	std::unordered_set<std::string> images;
+
+	mbtiles_sink(std::string const &fname, char **av, bool force, bool dedup_tiles) {
+		name = fname;
+		argv = av;
+		dedup = dedup_tiles;
+
+		if (force) {
+			unlink(name.c_str());
+		}
+		db = mbtiles_open((char *) name.c_str(), argv, false, true, dedup);
+	}
+
+	size_t max_writers() {
+		return sqlite3_limit(db, SQLITE_LIMIT_ATTACHED, -1);
+	}
+
+	tile_sink *writer(size_t i, size_t n) {
+		if (n == 1) {
+			return this;
+		}
+
+		mbtiles_sink *shard = new mbtiles_sink(name + ".shard" + std::to_string(i), argv, true, dedup);
+		shards.push_back(shard);
+		return shard;
+	}
+
+	void write_tile(int z, long long x, long long y, std::string const &data, std::string const &id) {
+		if (stmt == NULL) {
+			if (dedup) {
+				stmt = mbtiles_prepare_map(db);
+				image_stmt = mbtiles_prepare_image(db);
+			} else {
+				stmt = mbtiles_prepare_write(db);
+			}
+		}
+
+		if (batch_tiles == 0) {
+			sql_exec(db, "BEGIN TRANSACTION;");
+		}
+
+		if (dedup) {
+			mbtiles_write_map(stmt, db, z, x, y, id);
+
+			if (images.insert(id).second) {
+				mbtiles_write_image(image_stmt, db, id, data.data(), data.size());
+				batch_bytes += data.size();
+			}
+		} else {
+			mbtiles_write_tile(stmt, db, z, x, y, data.data(), data.size());
+			batch_bytes += data.size();
+		}
+
+		batch_tiles++;
+
+		if (batch_tiles >= WRITE_BATCH_TILES || batch_bytes >= WRITE_BATCH_BYTES) {
+			sql_exec(db, "COMMIT;");
+			batch_tiles = 0;
+			batch_bytes = 0;
+		}
+	}
+
+	void flush() {
+		if (batch_tiles != 0) {
+			sql_exec(db, "COMMIT;");
+			batch_tiles = 0;
+			batch_bytes = 0;
+		}
+
+		if (stmt != NULL) {
+			if (sqlite3_finalize(stmt) != SQLITE_OK) {
+				fprintf(stderr, "%s: sqlite3 finalize failed: %s\n", name.c_str(), sqlite3_errmsg(db));
+				exit(EXIT_FAILURE);
+			}
+			stmt = NULL;
+		}
+		if (image_stmt != NULL) {
+			if (sqlite3_finalize(image_stmt) != SQLITE_OK) {
+				fprintf(stderr, "%s: sqlite3 finalize failed: %s\n", name.c_str(), sqlite3_errmsg(db));
+				exit(EXIT_FAILURE);
+			}
+			image_stmt = NULL;
+		}
+	}
+
+	void write_metadata(std::vector<std::pair<std::string, std::string>> const &metadata) {
+		for (size_t i = 0; i < metadata.size(); i++) {
+			char *sql = sqlite3_mprintf("INSERT INTO metadata (name, value) VALUES (%Q, %Q);", metadata[i].first.c_str(), metadata[i].second.c_str());
+			sql_exec(db, sql);
+			sqlite3_free(sql);
+		}
+	}
+
+	void close() {
+		if (shards.size() > 0) {
+			std::vector<std::string> names;
+
+			for (size_t i = 0; i < shards.size(); i++) {
+				if (sqlite3_close(shards[i]->db) != SQLITE_OK) {
+					fprintf(stderr, "%s: could not close database: %s\n", shards[i]->name.c_str(), sqlite3_errmsg(shards[i]->db));
+					exit(EXIT_FAILURE);
+				}
+
+				names.push_back(shards[i]->name);
+				delete shards[i];
+			}
+
+			mbtiles_merge_shards(db, names, argv, dedup);
+
+			for (size_t i = 0; i < names.size(); i++) {
+				unlink(names[i].c_str());
+			}
+		}
+
+		mbtiles_close(db, argv);
+	}
+};
+
+// A directory tree of z/x/y files, which any number of writers can write
+// into at once. Directories are only made when a file can't be created.
+// Writing over an existing tree with -f first removes the tiles in it,
+// so that none are left over from before, but nothing else.
+
+struct directory_sink : tile_sink {
+	std::string name;
+
+	static bool numeric(const char *s, const char *end) {
+		if (s == end) {
+			return false;
+		}
+		for (; s < end; s++) {
+			if (*s < '0' || *s > '9') {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// The paths of the entries in dir whose names are numbers,
+	// followed by .pbf or .png if they are tiles
+	static std::vector<std::string> numbered(std::string const &dir, bool tiles) {
+		std::vector<std::string> out;
+
+		DIR *d = opendir(dir.c_str());
+		if (d == NULL) {
+			return out;
+		}
+
+		struct dirent *de;
+		while ((de = readdir(d)) != NULL) {
+			const char *end = de->d_name + strlen(de->d_name);
+			if (tiles) {
+				const char *dot = strrchr(de->d_name, '.');
+				if (dot == NULL || (strcmp(dot, ".pbf") != 0 && strcmp(dot, ".png") != 0)) {
+					continue;
+				}
+				end = dot;
+			}
+			if (numeric(de->d_name, end)) {
+				out.push_back(dir + "/" + de->d_name);
+			}
+		}
+
+		closedir(d);
+		return out;
+	}
+
+	static void remove_tiles(std::string const &dname) {
+		std::vector<std::string> zdirs = numbered(dname, false);
+
+		for (size_t z = 0; z < zdirs.size(); z++) {
+			std::vector<std::string> xdirs = numbered(zdirs[z], false);
+
+			for (size_t x = 0; x < xdirs.size(); x++) {
+				std::vector<std::string> tiles = numbered(xdirs[x], true);
+
+				for (size_t y = 0; y < tiles.size(); y++) {
+					if (unlink(tiles[y].c_str()) != 0) {
+						perror(tiles[y].c_str());
+						exit(EXIT_FAILURE);
+					}
+				}
+
+				rmdir(xdirs[x].c_str());  // unless something else is in it
+			}
+
+			rmdir(zdirs[z].c_str());
+		}
+	}
+
+	directory_sink(std::string const &dname, bool force) {
+		name = dname;
+
+		if (mkdir(name.c_str(), 0777) != 0 && errno != EEXIST) {
+			perror(name.c_str());
+			exit(EXIT_FAILURE);
+		}
+
+		std::string meta = name + "/metadata.json";
+		struct stat st;
+		if (!force && stat(meta.c_str(), &st) == 0) {
+			fprintf(stderr, "%s: already exists; use -f to write over it\n", meta.c_str());
+			exit(EXIT_FAILURE);
+		}
+		if (force) {
+			remove_tiles(name);
+		}
+	}
+
+	size_t max_writers() {
+		return SIZE_MAX;
+	}
+
+	size_t default_writers(size_t encoders) {
+		return encoders;
+	}
+
+	tile_sink *writer(size_t, size_t) {
+		return this;
+	}
+
+	static void make_dir(std::string const &dir) {
+		if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) {
+			perror(dir.c_str());
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	void write_tile(int z, long long x, long long y, std::string const &data, std::string const &) {
+		const char *ext = "pbf";
+		if (data.size() >= 4 && memcmp(data.data(), "\x89PNG", 4) == 0) {
+			ext = "png";
+		}
+
+		std::string zdir = name + "/" + std::to_string(z);
+		std::string xdir = zdir + "/" + std::to_string(x);
+		std::string fname = xdir + "/" + std::to_string(y) + "." + ext;
+
+		FILE *fp = fopen(fname.c_str(), "wb");
+		if (fp == NULL && errno == ENOENT) {
+			make_dir(zdir);
+			make_dir(xdir);
+			fp = fopen(fname.c_str(), "wb");
+		}
+		if (fp == NULL) {
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
+		}
+
+		if (fwrite(data.data(), sizeof(char), data.size(), fp) != data.size()) {
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
+		}
+		if (fclose(fp) != 0) {
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	void write_metadata(std::vector<std::pair<std::string, std::string>> const &metadata) {
+		std::string fname = name + "/metadata.json";
+		std::string json = metadata_json(metadata);
+
+		FILE *fp = fopen(fname.c_str(), "w");
+		if (fp == NULL) {
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
+		}
+		if (fwrite(json.data(), sizeof(char), json.size(), fp) != json.size()) {
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
+		}
+		if (fclose(fp) != 0) {
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	void close() {
+	}
+};
+
+// A single file, written by one writer, with the tiles appended as they come
+// and a directory sorted by zoom, column, and row at the end:
+//
+//   "tile-count-tiles"                        16-byte header
+//   tile data, back to back
+//   directory entries                         zoom (32 bits), column (32), row (32),
+//                                             offset of data (64), length of data (32)
+//   metadata, as a JSON object of strings
+//   offset of directory (64), number of entries (64),
+//   offset of metadata (64), length of metadata (64)
+//
+// Numbers are big-endian and rows are numbered from the top. With dedup,
+// tiles with the same ID as one already in the file share its data.
+
+#define ARCHIVE_HEADER "tile-count-tiles"
+#define ARCHIVE_HEADER_LEN 16
+
+struct archive_entry {
+	int z;
+	long long x;
+	long long y;
+	unsigned long long offset;
+	size_t len;
+
+	bool operator<(archive_entry const &o) const {
+		if (z < o.z) {
+			return true;
+		}
+		if (z == o.z) {
+			if (x < o.x) {
+				return true;
+			}
+			if (x == o.x) {
+				if (y < o.y) {
+					return true;
+				}
+			}
+		}
+
+		return false;
+	}
+};
+
+struct archive_sink : tile_sink {
+	std::string name;
+	FILE *fp;
+	unsigned long long off;
+	std::vector<archive_entry> entries;
+	std::vector<std::pair<std::string, std::string>> metadata;
+
+	std::unordered_map<std::string, unsigned long long> stored;  // offsets by ID
+
+	archive_sink(std::string const &fname, bool force) {
+		name = fname;
+
+		if (!force) {
+			struct stat st;
+			if (stat(name.c_str(), &st) == 0) {
+				fprintf(stderr, "%s: already exists; use -f to write over it\n", name.c_str());
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		fp = fopen(name.c_str(), "wb");
+		if (fp == NULL) {
+			perror(name.c_str());
+			exit(EXIT_FAILURE);
+		}
+
+		if (fwrite(ARCHIVE_HEADER, ARCHIVE_HEADER_LEN, 1, fp) != 1) {
+			perror(name.c_str());
+			exit(EXIT_FAILURE);
+		}
+		off = ARCHIVE_HEADER_LEN;
+	}
+
+	size_t max_writers() {
+		return 1;
+	}
+
+	tile_sink *writer(size_t, size_t) {
+		return this;
+	}
+
+	void write_tile(int z, long long x, long long y, std::string const &data, std::string const &id) {
+		// The directory only has 32 bits for each of these
+		if (x < 0 || x > UINT_MAX || y < 0 || y > UINT_MAX) {
+			fprintf(stderr, "%s: Tile %d/%lld/%lld is out of range for an archive\n", name.c_str(), z, x, y);
+			exit(EXIT_FAILURE);
+		}
+		if (data.size() > UINT_MAX) {
+			fprintf(stderr, "%s: Tile %d/%lld/%lld is too big for an archive: %zu bytes\n", name.c_str(), z, x, y, data.size());
+			exit(EXIT_FAILURE);
+		}
+
+		archive_entry e;
+		e.z = z;
+		e.x = x;
+		e.y = y;
+		e.len = data.size();
+
+		if (id.size() != 0) {
+			auto f = stored.find(id);
+
+			if (f != stored.end()) {
+				e.offset = f->second;
+				entries.push_back(e);
+				return;
+			}
+
+			stored.insert(std::pair<std::string, unsigned long long>(id, off));
+		}
+
+		if (fwrite(data.data(), sizeof(char), data.size(), fp) != data.size()) {
+			perror(name.c_str());
+			exit(EXIT_FAILURE);
+		}
+
+		e.offset = off;
+		off += data.size();
+		entries.push_back(e);
+	}
+
+	void write_metadata(std::vector<std::pair<std::string, std::string>> const &meta) {
+		metadata = meta;
+	}
+
+	void close() {
+		std::sort(entries.begin(), entries.end());
+
+		unsigned long long directory = off;
+		for (size_t i = 0; i < entries.size(); i++) {
+			write32(fp, entries[i].z);
+			write32(fp, entries[i].x);
+			write32(fp, entries[i].y);
+			write64(fp, entries[i].offset);
+			write32(fp, entries[i].len);
+		}
+
+		std::string json = metadata_json(metadata);
+		unsigned long long meta = directory + entries.size() * 24;
+		if (fwrite(json.data(), sizeof(char), json.size(), fp) != json.size()) {
+			perror(name.c_str());
+			exit(EXIT_FAILURE);
+		}
+
+		write64(fp, directory);
+		write64(fp, entries.size());
+		write64(fp, meta);
+		write64(fp, json.size());
+
+		if (fclose(fp) != 0) {
+			perror(name.c_str());
+			exit(EXIT_FAILURE);
+		}
+	}
+};
+
+tile_sink *open_sink(const char *format, const char *name, char **argv, bool force, bool dedup) {
+	if (strcmp(format, "mbtiles") == 0) {
+		return new mbtiles_sink(name, argv, force, dedup);
+	} else if (strcmp(format, "directory") == 0) {
+		return new directory_sink(name, force);
+	} else if (strcmp(format, "archive") == 0) {
+		return new archive_sink(name, force);
+	} else {
+		fprintf(stderr, "%s: Unknown output format %s\n", argv[0], format);
+		exit(EXIT_FAILURE);
+	}
+}
@@ -0,0 +1,43 @@
+// Where finished tiles go. Tiles are written by one or more writer threads,
+// each of which writes to the sink that writer() gives it; those must be
+// safe to use from one thread each at the same time. Once all the writers
+// are done, the metadata is written and the sink is closed.
+
+struct tile_sink {
+	virtual ~tile_sink() {
+	}
+
+	// The most writer threads that the sink can be written by
+	virtual size_t max_writers() = 0;
+
+	// How many writer threads to use if not told, given how many
+	// threads are encoding tiles
+	virtual size_t default_writers(size_t) {
+		return 1;
+	}
+
+	// The sink for the specified one of n writer threads
+	virtual tile_sink *writer(size_t i, size_t n) = 0;
+
+	// Tiles are numbered from the top left, whatever the format stores.
+	// With dedup, id is the tile_id() of the data; otherwise it is empty.
+	virtual void write_tile(int z, long long x, long long y, std::string const &data, std::string const &id) = 0;
+
+	// Called by each writer thread when it has no more tiles
+	virtual void flush() {
+	}
+
+	virtual void write_metadata(std::vector<std::pair<std::string, std::string>> const &metadata) = 0;
+
+	virtual void close() = 0;
+};
+
+// format is "mbtiles", "directory", or "archive". With dedup, identical tiles
+// are only stored once, except in directories.
+tile_sink *open_sink(const char *format, const char *name, char **argv, bool force, bool dedup);
+
+// An ID for the contents of a tile, the same for identical tiles
+std::string tile_id(std::string const &data);
+
+// The name/value pairs from the metadata table of a database
+std::vector<std::pair<std::string, std::string>> read_metadata(sqlite3 *db);
@@ -0,0 +1,83 @@
+#!/usr/local/bin/node
+
+'use strict';
+
+// Print the tiles in a directory or archive written by tile-count-tile as
+// zoom|column|row|hex data, in zoom, column, row order, or with --metadata,
+// its metadata as name|value, sorted by name, in the same form as
+//
+//     sqlite3 out.mbtiles 'select zoom_level, tile_column, (1 << zoom_level) - 1 - tile_row, hex(tile_data) from tiles order by 1, 2, 3'
+//     sqlite3 out.mbtiles 'select name, value from metadata order by name'
+
+var fs = require('fs');
+var path = require('path');
+
+var metadataOnly = false;
+var fname = process.argv[2];
+if (fname === '--metadata') {
+	metadataOnly = true;
+	fname = process.argv[3];
+}
+
+var tiles = [];
+var metadata;
+
+function readDirectory(dir) {
+	fs.readdirSync(dir).forEach(function(z) {
+		if (!/^[0-9]+$/.test(z)) {
+			return;
+		}
+		fs.readdirSync(path.join(dir, z)).forEach(function(x) {
+			fs.readdirSync(path.join(dir, z, x)).forEach(function(file) {
+				var y = file.replace(/\.(pbf|png)$/, '');
+				tiles.push([Number(z), Number(x), Number(y), fs.readFileSync(path.join(dir, z, x, file))]);
+			});
+		});
+	});
+
+	metadata = JSON.parse(fs.readFileSync(path.join(dir, 'metadata.json'), 'utf8'));
+}
+
+function readArchive(file) {
+	var buf = fs.readFileSync(file);
+
+	if (buf.toString('latin1', 0, 16) !== 'tile-count-tiles') {
+		console.error(file + ": not a tile-count archive");
+		process.exit(1);
+	}
+
+	var end = buf.length - 32;
+	var directory = Number(buf.readBigUInt64BE(end));
+	var entries = Number(buf.readBigUInt64BE(end + 8));
+	var meta = Number(buf.readBigUInt64BE(end + 16));
+	var metaLen = Number(buf.readBigUInt64BE(end + 24));
+
+	var i;
+	for (i = 0; i < entries; i++) {
+		var e = directory + 24 * i;
+		var offset = Number(buf.readBigUInt64BE(e + 12));
+		var len = buf.readUInt32BE(e + 20);
+		tiles.push([buf.readUInt32BE(e), buf.readUInt32BE(e + 4), buf.readUInt32BE(e + 8), buf.slice(offset, offset + len)]);
+	}
+
+	metadata = JSON.parse(buf.toString('utf8', meta, meta + metaLen));
+}
+
+if (fs.statSync(fname).isDirectory()) {
+	readDirectory(fname);
+} else {
+	readArchive(fname);
+}
+
+if (metadataOnly) {
+	Object.keys(metadata).sort().forEach(function(name) {
+		console.log(name + '|' + metadata[name]);
+	});
+} else {
+	tiles.sort(function(a, b) {
+		return a[0] - b[0] || a[1] - b[1] || a[2] - b[2];
+	});
+	tiles.forEach(function(t) {
+		console.log(t[0] + '|' + t[1] + '|' + t[2] + '|' + t[3].toString('hex').toUpperCase());
+	});
+}
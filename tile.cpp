@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <string.h>
 #include <sqlite3.h>
 #include <sys/stat.h>
@@ -9,14 +10,19 @@
 #include <set>
 #include <map>
 #include <queue>
+#include <deque>
+#include <atomic>
 #include <algorithm>
 #include <fcntl.h>
 #include <pthread.h>
 #include <sys/mman.h>
 #include <limits.h>
+#include <limits>
+#include <unordered_map>
 #include <math.h>
 #include <time.h>
 #include <png.h>
+#include <zlib.h>
 #include "tippecanoe/projection.hpp"
 #include "protozero/varint.hpp"
 #include "protozero/pbf_reader.hpp"
@@ -25,539 +31,2315 @@
 #include "serial.hpp"
 #include "tippecanoe/mvt.hpp"
 #include "tippecanoe/mbtiles.hpp"
+#include "sink.hpp"
+#include "quantize.hpp"
+#include "compress.hpp"
+#include "scan.hpp"
+
+// A rectangle costs about as much as this many points: it is 10 numbers
+// and 3 commands where a point is 2 numbers, and compression closes the
+// gap somewhat.
+#define RING_COST 6
+
+// The kinds of tiles, for choosing the encoding kernel
+#define OUTPUT_PNG 0
+#define OUTPUT_SINGLE 1   // a feature for each pixel
+#define OUTPUT_GROUPED 2  // a feature for each level
+#define OUTPUT_MODES 3
 
-int levels = 50;
-int first_level = 0;
-int first_count = 0;
-double count_gamma = 2.5;
+bool quiet = false;
 
-bool bitmap = false;
-int color = 0x888888;
-int white = 0;
+#define MAX_TILE_SIZE 500000
 
-bool single_polygons = false;
-bool limit_tile_sizes = true;
-bool increment_threshold = false;
-bool points = false;
+struct tile_writer;
+
+// How the tiles of one output look, and where they go. Every output of a
+// run is made from the same accumulated counts, so the options that
+// decide what is accumulated (zooms, detail, bin size) are shared.
+struct output {
+	int levels = 50;
+	int first_level = 0;
+	int first_count = 0;
+	double count_gamma = 2.5;
+
+	bool bitmap = false;
+	int color = 0x888888;
+	int white = 0;
+
+	bool single_polygons = false;
+	bool limit_tile_sizes = true;
+	bool increment_threshold = false;
+	bool points = false;
+	bool adaptive = false;  // choose between points and merged polygons for each tile
+	bool include_density = false;
+	bool include_count = false;
+	std::string layername = "count";
 
-bool quiet = false;
-bool include_density = false;
-bool include_count = false;
+	const char *outfile = NULL;
+	const char *format = "mbtiles";
+	bool dedup = false;
+
+	// Worked out once the options are known
+	int mode = OUTPUT_GROUPED;
+	std::string png_palette;            // the PLTE and tRNS chunks
+	std::vector<quantizer> quantizers;  // for each zoom level, once its max is known
+	tile_sink *sink = NULL;
+	std::vector<tile_writer *> writers;  // one for each shard
+
+	// With dedup, compressed tiles by the pixels they were made from
+	std::unordered_map<std::string, std::string> blob_cache;
+	size_t blob_cache_bytes = 0;
+	pthread_mutex_t blob_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+};
 
-#define MAX_TILE_SIZE 500000
+std::vector<output *> outputs;
 
 void usage(char **argv) {
-	fprintf(stderr, "Usage: %s [options] -o out.mbtiles file.count\n", argv[0]);
+	fprintf(stderr, "Usage: %s [options] -o out.mbtiles [--output 'other.mbtiles options' ...] file.count\n", argv[0]);
+}
+
+// Spread the bits of a pixel coordinate out to every other bit position,
+// and gather them back, to convert between x/y and Z-order pixel indices.
+
+static inline unsigned long long morton_spread(unsigned long long v) {
+	v = (v | (v << 16)) & 0x0000FFFF0000FFFFULL;
+	v = (v | (v << 8)) & 0x00FF00FF00FF00FFULL;
+	v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	v = (v | (v << 2)) & 0x3333333333333333ULL;
+	v = (v | (v << 1)) & 0x5555555555555555ULL;
+	return v;
+}
+
+static inline unsigned long long morton_compact(unsigned long long v) {
+	v &= 0x5555555555555555ULL;
+	v = (v | (v >> 1)) & 0x3333333333333333ULL;
+	v = (v | (v >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+	v = (v | (v >> 4)) & 0x00FF00FF00FF00FFULL;
+	v = (v | (v >> 8)) & 0x0000FFFF0000FFFFULL;
+	v = (v | (v >> 16)) & 0x00000000FFFFFFFFULL;
+	return v;
+}
+
+// The kernels that go through every pixel are compiled separately for each
+// of the common details, so that the shifts and masks by the detail are
+// constants, and once more for any detail. DETAIL is ANY_DETAIL in the one
+// that uses the detail it is given.
+
+#define ANY_DETAIL -1
+#define MIN_FIXED_DETAIL 7
+#define MAX_FIXED_DETAIL 12
+
+template <int DETAIL>
+static inline size_t fixed_detail(size_t detail) {
+	return DETAIL == ANY_DETAIL ? detail : DETAIL;
 }
 
+// A tile keeps track of which of its pixels have been touched while only
+// a small fraction of them have, so that clearing and scanning it can skip
+// the empty ones. Past that fraction it falls back to treating the whole
+// grid as occupied until it is cleared.
+//
+// Tiles accumulated from a .count file store their pixels in Z-order,
+// the same order the records arrive in, so that consecutive records land
+// near each other in memory. Tiles decoded from existing tilesets, whose
+// pixels arrive by rows, store them in row-major order.
+//
+// The counters start out 16 bits wide and are widened for the whole tile,
+// to 32 and then 64 bits, the first time a pixel would overflow them.
+// Only the vector for the current width is allocated.
+
+#define SPARSE_FRACTION 16
+
 struct tile {
 	long long x;
 	long long y;
 	int z;
-	std::vector<long long> count;
+	size_t detail;
+	bool morton;
+	int bits;
+	std::vector<unsigned short> count16;
+	std::vector<unsigned> count32;
+	std::vector<unsigned long long> count64;
+	unsigned long long max;		// largest count in the tile
+	std::vector<unsigned> touched;  // pixels that are nonzero, unless dense
+	bool dense;
 	bool active;
 
-	tile(size_t dim, int zoom) {
+	tile(size_t dim, int zoom, bool morton_order = false) {
 		x = -1;
 		y = -1;
 		z = zoom;
-		count.resize((1 << dim) * (1 << dim), 0);
+		detail = dim;
+		morton = morton_order;
+		bits = 16;
+		count16.resize(size(), 0);
+		max = 0;
+		dense = false;
 		active = false;
 	}
+
+	size_t size() const {
+		return (1ULL << detail) * (1ULL << detail);
+	}
+
+	template <int DETAIL>
+	size_t index(size_t px, size_t py) const {
+		if (morton) {
+			return morton_spread(px) | (morton_spread(py) << 1);
+		} else {
+			return (py << fixed_detail<DETAIL>(detail)) + px;
+		}
+	}
+
+	size_t index(size_t px, size_t py) const {
+		return index<ANY_DETAIL>(px, py);
+	}
+
+	template <int DETAIL>
+	void position(size_t i, size_t &px, size_t &py) const {
+		if (morton) {
+			px = morton_compact(i);
+			py = morton_compact(i >> 1);
+		} else {
+			px = i & ((1U << fixed_detail<DETAIL>(detail)) - 1);
+			py = i >> fixed_detail<DETAIL>(detail);
+		}
+	}
+
+	void resize(size_t dim) {
+		clear();
+		detail = dim;
+
+		if (bits == 16) {
+			count16.resize(size(), 0);
+		} else if (bits == 32) {
+			count32.resize(size(), 0);
+		} else {
+			count64.resize(size(), 0);
+		}
+	}
+
+	unsigned long long get(size_t i) const {
+		if (bits == 16) {
+			return count16[i];
+		} else if (bits == 32) {
+			return count32[i];
+		} else {
+			return count64[i];
+		}
+	}
+
+	// Make the counters wide enough to hold the specified value
+	void widen(unsigned long long v) {
+		if (bits == 16 && v > USHRT_MAX) {
+			std::vector<unsigned short> old;
+			old.swap(count16);
+
+			if (v > UINT_MAX) {
+				count64.assign(old.begin(), old.end());
+				bits = 64;
+			} else {
+				count32.assign(old.begin(), old.end());
+				bits = 32;
+			}
+		} else if (bits == 32 && v > UINT_MAX) {
+			std::vector<unsigned> old;
+			old.swap(count32);
+
+			count64.assign(old.begin(), old.end());
+			bits = 64;
+		}
+	}
+
+	template <typename T>
+	void add(std::vector<T> &count, size_t i, unsigned long long n) {
+		unsigned long long v = count[i];
+
+		if (v == 0 && !dense) {
+			if (touched.size() >= size() / SPARSE_FRACTION) {
+				make_dense();
+			} else {
+				touched.push_back(i);
+			}
+		}
+
+		v += n;
+		if (v > max) {
+			max = v;
+		}
+
+		if (v > std::numeric_limits<T>::max()) {
+			widen(v);
+
+			if (bits == 32) {
+				count32[i] = v;
+			} else {
+				count64[i] = v;
+			}
+		} else {
+			count[i] = v;
+		}
+	}
+
+	void add(size_t i, unsigned long long n) {
+		if (n == 0) {
+			return;
+		}
+
+		if (bits == 16) {
+			add(count16, i, n);
+		} else if (bits == 32) {
+			add(count32, i, n);
+		} else {
+			add(count64, i, n);
+		}
+	}
+
+	void make_dense() {
+		dense = true;
+		touched.clear();
+	}
+
+	template <typename T>
+	void clear(std::vector<T> &count) {
+		if (dense) {
+			std::fill(count.begin(), count.end(), 0);
+		} else {
+			for (size_t i = 0; i < touched.size(); i++) {
+				count[touched[i]] = 0;
+			}
+		}
+	}
+
+	void clear() {
+		if (bits == 16) {
+			clear(count16);
+		} else if (bits == 32) {
+			clear(count32);
+		} else {
+			clear(count64);
+		}
+
+		dense = false;
+		touched.clear();
+		max = 0;
+	}
+
+	// Take over the counts, detail, and location of another tile,
+	// leaving it with this one's counts and detail in their place
+	void take(tile &o) {
+		x = o.x;
+		y = o.y;
+		z = o.z;
+
+		std::swap(detail, o.detail);
+		std::swap(bits, o.bits);
+		std::swap(max, o.max);
+		std::swap(dense, o.dense);
+		count16.swap(o.count16);
+		count32.swap(o.count32);
+		count64.swap(o.count64);
+		touched.swap(o.touched);
+	}
+
+	template <int DETAIL, typename T>
+	void nonzero(std::vector<T> const &count, std::vector<unsigned> &out) const {
+		size_t d = fixed_detail<DETAIL>(detail);
+
+		for (size_t py = 0; py < (1U << d); py++) {
+			for (size_t px = 0; px < (1U << d); px++) {
+				if (count[index<DETAIL>(px, py)] != 0) {
+					out.push_back((py << d) + px);
+				}
+			}
+		}
+	}
+
+	// The nonzero pixels, as y * width + x, in row-major order,
+	// whatever order they are stored in
+	template <int DETAIL>
+	void nonzero(std::vector<unsigned> &out) const {
+		size_t d = fixed_detail<DETAIL>(detail);
+		out.clear();
+
+		if (dense) {
+			if (bits == 16) {
+				nonzero<DETAIL>(count16, out);
+			} else if (bits == 32) {
+				nonzero<DETAIL>(count32, out);
+			} else {
+				nonzero<DETAIL>(count64, out);
+			}
+		} else {
+			out.resize(touched.size());
+			for (size_t i = 0; i < touched.size(); i++) {
+				size_t px, py;
+				position<DETAIL>(touched[i], px, py);
+				out[i] = (py << d) + px;
+			}
+			std::sort(out.begin(), out.end());
+		}
+	}
+
+	template <int DETAIL, typename T>
+	void values(std::vector<T> const &count, std::vector<unsigned> const &pixels, std::vector<long long> &out) const {
+		size_t d = fixed_detail<DETAIL>(detail);
+		out.resize(pixels.size());
+
+		for (size_t i = 0; i < pixels.size(); i++) {
+			out[i] = count[index<DETAIL>(pixels[i] & ((1U << d) - 1), pixels[i] >> d)];
+		}
+	}
+
+	// The counts for the specified pixels, as numbered by nonzero()
+	template <int DETAIL>
+	void values(std::vector<unsigned> const &pixels, std::vector<long long> &out) const {
+		if (bits == 16) {
+			values<DETAIL>(count16, pixels, out);
+		} else if (bits == 32) {
+			values<DETAIL>(count32, pixels, out);
+		} else {
+			values<DETAIL>(count64, pixels, out);
+		}
+	}
+};
+
+// A range of records, made of whole tiles at the split zoom
+struct task {
+	size_t start;
+	size_t end;
+};
+
+struct shared_tile {
+	tile tl;
+	pthread_mutex_t lock;
+
+	shared_tile(size_t detail, int z)
+	    : tl(detail, z, true) {
+		pthread_mutex_init(&lock, NULL);
+	}
+
+	~shared_tile() {
+		pthread_mutex_destroy(&lock);
+	}
+};
+
+#define TASKS_PER_CPU 4
+
+// A tile completed on the first pass, kept as the indices of its nonzero
+// pixels and their counts, so that the second pass can encode it without
+// reading its records again
+
+struct kept_tile {
+	long long x;
+	long long y;
+	int z;
+	std::vector<unsigned> cells;
+	std::vector<long long> raw;
+};
+
+// The tiles completed by one task. If they stop fitting in what is left of
+// the budget, they are all let go, and the task is run again on the second pass.
+struct kept_task {
+	bool kept;
+	size_t bytes;
+	std::vector<kept_tile> tiles;
+};
+
+// Shared among the threads tiling one group of zoom levels
+struct tiling_state {
+	std::vector<task> tasks;
+	std::atomic<size_t> next;
+	std::atomic<size_t> done;
+	size_t records;
+	size_t splitzoom;
+	std::vector<size_t> details;  // by zoom
+
+	std::vector<kept_task> *kept;    // by task, or NULL if nothing is being kept
+	std::atomic<long long> *budget;  // bytes left for keeping them
+
+	// Tiles below the split zoom, by zoom level
+	std::vector<std::map<std::pair<long long, long long>, shared_tile *>> shared;
+	pthread_mutex_t shared_lock;
+
+	// The ones at the zoom level currently being finished
+	std::vector<shared_tile *> level;
+
+	tiling_state() {
+		next = 0;
+		done = 0;
+		pthread_mutex_init(&shared_lock, NULL);
+	}
+
+	~tiling_state() {
+		pthread_mutex_destroy(&shared_lock);
+	}
 };
 
+struct encoder_pool;
+
 struct tiler {
 	std::vector<tile> tiles;
-	std::vector<tile> partial_tiles;
-	std::vector<long long> max;       // for this thread
-	std::vector<long long> zoom_max;  // global on 2nd pass
+	std::vector<long long> max;  // for this thread
 	size_t pass;
-	size_t start;
-	size_t end;
 	long long bbox[4];
 	long long midx, midy;
 	long long atmid;
+	unsigned long long atindex;
+
+	record_file *input;
+	size_t minzoom;  // lowest zoom being tiled in this pass
+	size_t topzoom;  // zoom being accumulated from the records in this pass
+	size_t zooms;
+	size_t detail;  // of the tiles at topzoom
+	int maxzoom;
+	tiling_state *state;
+	encoder_pool *encoders;  // on 2nd pass
+	kept_task *keeping;      // for the task being run on the 1st pass, or NULL
+
+	size_t percent;
+	size_t step;   // for progress, of the total number of passes
+	size_t steps;  // over the input
+};
+
+// The kernels for one detail, with an encoder for each kind of output,
+// so that the choice is made once for each tile, not for every pixel
+
+struct tile_kernels {
+	void (*run_task)(tiler *t, task const &tk);
+	void (*reduce_into)(tile &parent, tile const &child);
+
+	// The nonzero pixels of a tile, as from tile::nonzero(), and their counts
+	void (*pixels)(tile const &t, std::vector<unsigned> &cells, std::vector<long long> &raw);
+
+	// The compressed tile for the quantized pixels, or empty if there is nothing in it,
+	// by output mode
+	std::string (*encode[OUTPUT_MODES])(output const &o, std::vector<unsigned> const &cells, std::vector<long long> const &counts, std::vector<long long> const &normalized, int detail, quantizer const &q);
+};
+
+tile_kernels const &kernels_for(size_t detail);
+
+static void fail(png_structp png_ptr, png_const_charp error_msg) {
+	fprintf(stderr, "PNG error %s\n", error_msg);
+	exit(EXIT_FAILURE);
+}
+
+// The quantizers for each zoom level of each output, once their max is known
+void make_quantizers(std::vector<long long> const &zoom_max) {
+	for (size_t i = 0; i < outputs.size(); i++) {
+		output &o = *outputs[i];
+
+		o.quantizers.clear();
+		for (size_t z = 0; z < zoom_max.size(); z++) {
+			o.quantizers.push_back(quantizer(o.levels, o.count_gamma, zoom_max[z], o.first_level));
+		}
+	}
+}
+
+// Each output with dedup keeps its compressed tiles, by the quantized pixels
+// they were made from, so that repeats of a tile can skip encoding and
+// compression. When the cache fills up it is emptied and starts again.
+#define BLOB_CACHE_BYTES (32 * 1024 * 1024)
+#define BLOB_KEY_BYTES (BLOB_CACHE_BYTES / 64)
+
+// What goes into the tile: the pixels that are drawn, and their levels and counts.
+// Empty if the tile is too big to be worth caching.
+std::string blob_key(output const &o, std::vector<unsigned> const &cells, std::vector<long long> const &counts, std::vector<long long> const &normalized, int detail, long long zoom_max) {
+	std::string key;
+	bool grouped = o.mode == OUTPUT_GROUPED;
+
+	key.append((char *) &detail, sizeof(detail));
+	if (grouped) {
+		// which levels are drawn, and their counts, depend on the zoom's max
+		key.append((char *) &zoom_max, sizeof(zoom_max));
+	}
+
+	for (size_t i = 0; i < cells.size(); i++) {
+		if (o.mode != OUTPUT_SINGLE ? normalized[i] == 0 : counts[i] == 0) {
+			continue;
+		}
+
+		key.append((char *) &cells[i], sizeof(cells[i]));
+		key.append((char *) &normalized[i], sizeof(normalized[i]));
+		if (o.mode == OUTPUT_SINGLE && o.include_count) {
+			key.append((char *) &counts[i], sizeof(counts[i]));
+		}
+
+		if (key.size() > BLOB_KEY_BYTES) {
+			return "";
+		}
+	}
+
+	return key;
+}
+
+bool find_blob(output &o, std::string const &key, std::string &blob) {
+	bool found = false;
+
+	pthread_mutex_lock(&o.blob_cache_lock);
+	auto f = o.blob_cache.find(key);
+	if (f != o.blob_cache.end()) {
+		blob = f->second;
+		found = true;
+	}
+	pthread_mutex_unlock(&o.blob_cache_lock);
+
+	return found;
+}
+
+void store_blob(output &o, std::string const &key, std::string const &blob) {
+	pthread_mutex_lock(&o.blob_cache_lock);
+	if (o.blob_cache_bytes + key.size() + blob.size() > BLOB_CACHE_BYTES) {
+		o.blob_cache.clear();
+		o.blob_cache_bytes = 0;
+	}
+	if (o.blob_cache.insert(std::pair<std::string, std::string>(key, blob)).second) {
+		o.blob_cache_bytes += key.size() + blob.size();
+	}
+	pthread_mutex_unlock(&o.blob_cache_lock);
+}
+
+// A rectangle of pixels at some level, to be drawn as one polygon ring
+struct pixel_rect {
+	long long level;
+	long long x0, y0, x1, y1;  // x1 and y1 are past the end
+};
+
+void add_rect(std::vector<pixel_rect> &rects, long long level, long long x0, long long y0, long long x1, long long y1) {
+	pixel_rect r = {level, x0, y0, x1, y1};
+	rects.push_back(r);
+}
+
+struct pixel_run {
+	long long x0, x1;  // x1 is past the end
+	long long y0;      // the first row, for rectangles
+	long long level;
+};
+
+// Rings covering the same pixels at the same levels as one per pixel,
+// but with each horizontal run of pixels at the same level as a single
+// ring, and runs that are exactly the same in the rows below them made
+// into one taller rectangle.
+// cells must be in row-major order, as from tile::nonzero().
+template <int DETAIL>
+void merge_rings(std::vector<unsigned> const &cells, std::vector<long long> const &normalized, size_t detail, std::vector<pixel_rect> &rects) {
+	detail = fixed_detail<DETAIL>(detail);
+	std::vector<pixel_run> open;  // rectangles that reached the last row, from left to right
+	std::vector<pixel_run> row;   // runs in this row
+	std::vector<pixel_run> still_open;
+	long long at_y = -1;
+
+	for (size_t i = 0; i <= cells.size(); i++) {
+		long long x = 0, y = -1;
+		if (i < cells.size()) {
+			if (normalized[i] == 0) {
+				continue;
+			}
+
+			x = cells[i] & ((1U << detail) - 1);
+			y = cells[i] >> detail;
+
+			if (y == at_y && row.size() > 0 && row.back().x1 == x && row.back().level == normalized[i]) {
+				row.back().x1++;
+				continue;
+			}
+			if (y == at_y) {
+				pixel_run r = {x, x + 1, y, normalized[i]};
+				row.push_back(r);
+				continue;
+			}
+		}
+
+		// Starting a new row, or at the end: the row that was being collected
+		// continues the open rectangles that it matches, and the rest are done.
+
+		still_open.clear();
+		size_t o = 0;
+		for (size_t j = 0; j < row.size(); j++) {
+			while (o < open.size() && open[o].x0 < row[j].x0) {
+				add_rect(rects, open[o].level, open[o].x0, open[o].y0, open[o].x1, at_y);
+				o++;
+			}
+			if (o < open.size() && open[o].x0 == row[j].x0 && open[o].x1 == row[j].x1 && open[o].level == row[j].level) {
+				still_open.push_back(open[o]);
+				o++;
+			} else {
+				still_open.push_back(row[j]);
+			}
+		}
+		for (; o < open.size(); o++) {
+			add_rect(rects, open[o].level, open[o].x0, open[o].y0, open[o].x1, at_y);
+		}
+
+		// Rectangles that skip a row are done too
+		open.clear();
+		for (size_t j = 0; j < still_open.size(); j++) {
+			if (i < cells.size() && y == at_y + 1) {
+				open.push_back(still_open[j]);
+			} else {
+				add_rect(rects, still_open[j].level, still_open[j].x0, still_open[j].y0, still_open[j].x1, at_y + 1);
+			}
+		}
+
+		row.clear();
+		if (i < cells.size()) {
+			at_y = y;
+			pixel_run r = {x, x + 1, y, normalized[i]};
+			row.push_back(r);
+		}
+	}
+}
+
+// PNGs are written here rather than through libpng, so that the palette is
+// only made once and the rows are compressed by a deflate stream that is
+// reused from tile to tile. Rows are not filtered, which suits palette images.
+
+void append32(std::string &out, unsigned long v) {
+	unsigned char b[4] = {(unsigned char) (v >> 24), (unsigned char) (v >> 16), (unsigned char) (v >> 8), (unsigned char) v};
+	out.append((char *) b, 4);
+}
+
+// The length, type, and data of the chunk from start in out are already
+// there; fill in the length and add the CRC.
+void finish_chunk(std::string &out, size_t start) {
+	size_t len = out.size() - start - 8;
+	for (size_t i = 0; i < 4; i++) {
+		out[start + i] = len >> (24 - 8 * i);
+	}
+	append32(out, crc32(0, (const Bytef *) out.data() + start + 4, len + 4));
+}
+
+void png_chunk(std::string &out, const char *type, const unsigned char *data, size_t len) {
+	size_t start = out.size();
+	append32(out, 0);
+	out.append(type, 4);
+	if (len > 0) {
+		out.append((const char *) data, len);
+	}
+	finish_chunk(out, start);
+}
+
+// The lower half of the levels fade in in the color, and the upper half
+// go from the color to the foreground
+void make_palette(output &o) {
+	int levels = o.levels;
+	int color = o.color;
+
+	if (levels > 256) {
+		fprintf(stderr, "Can't have more than 256 levels in PNG tiles\n");
+		exit(EXIT_FAILURE);
+	}
+
+	unsigned char transparency[levels];
+	unsigned char colors[levels * 3];
+	for (int i = 0; i < levels / 2; i++) {
+		colors[3 * i + 0] = (color >> 16) & 0xFF;
+		colors[3 * i + 1] = (color >> 8) & 0xFF;
+		colors[3 * i + 2] = (color >> 0) & 0xFF;
+		transparency[i] = 255 * i / (levels / 2);
+	}
+	for (int i = levels / 2; i < levels; i++) {
+		double along = 1;
+		if (levels - levels / 2 - 1 > 0) {
+			along = 255 * (i - levels / 2) / (levels - levels / 2 - 1) / 255.0;
+		}
+		int fg = o.white ? 0x00 : 0xFF;
+
+		colors[3 * i + 0] = ((color >> 16) & 0xFF) * (1 - along) + fg * (along);
+		colors[3 * i + 1] = ((color >> 8) & 0xFF) * (1 - along) + fg * (along);
+		colors[3 * i + 2] = ((color >> 0) & 0xFF) * (1 - along) + fg * (along);
+		transparency[i] = 255;
+	}
+
+	o.png_palette.clear();
+	png_chunk(o.png_palette, "PLTE", colors, levels * 3);
+	png_chunk(o.png_palette, "tRNS", transparency, levels);
+}
+
+// The PNG for the levels of the pixels. cells must be in row-major order.
+template <int DETAIL>
+std::string encode_png(output const &o, std::vector<unsigned> const &cells, std::vector<long long> const &counts, std::vector<long long> const &normalized, int detail_, quantizer const &q) {
+	size_t detail = fixed_detail<DETAIL>(detail_);
+	size_t width = 1U << detail;
+
+	std::string out("\x89PNG\r\n\x1a\n", 8);
+
+	size_t start = out.size();
+	append32(out, 0);
+	out.append("IHDR", 4);
+	append32(out, width);
+	append32(out, width);
+	out.push_back(8);  // bit depth
+	out.push_back(3);  // palette color
+	out.push_back(0);  // deflate
+	out.push_back(0);  // adaptive filtering, though every row is unfiltered
+	out.push_back(0);  // not interlaced
+	finish_chunk(out, start);
+
+	out.append(o.png_palette);
+
+	start = out.size();
+	append32(out, 0);
+	out.append("IDAT", 4);
+
+	compressor *c = start_compression(false);
+	std::vector<unsigned char> row(width + 1);
+	size_t i = 0;
+	for (size_t y = 0; y < width; y++) {
+		std::fill(row.begin(), row.end(), 0);  // including the filter type, none
+		for (; i < cells.size() && (cells[i] >> detail) == y; i++) {
+			row[1 + (cells[i] & (width - 1))] = normalized[i];
+		}
+		compress_more(c, row.data(), row.size());
+	}
+	finish_compression(c, out);
+	finish_chunk(out, start);
+
+	png_chunk(out, "IEND", NULL, 0);
+	return out;
+}
+
+// Vector tiles are written straight from the pixels, not through an mvt_tile,
+// so that nothing is allocated for each pixel. The bytes are the same as
+// mvt_tile::encode() makes from the equivalent features.
+
+#define GEOMETRY_COMMAND(op, n) (((n) << 3) | (op))
+
+// The values of attributes in a layer, numbered in the order they are first used
+struct value_pool {
+	std::vector<unsigned long long> values;
+	std::vector<long long> slots;  // indices into values, or -1
+
+	size_t index(unsigned long long v) {
+		if (slots.size() < 2 * (values.size() + 1)) {
+			grow();
+		}
+
+		size_t mask = slots.size() - 1;
+		for (size_t h = (v * 0x9E3779B97F4A7C15ULL) >> 32 & mask;; h = (h + 1) & mask) {
+			if (slots[h] < 0) {
+				slots[h] = values.size();
+				values.push_back(v);
+				return slots[h];
+			}
+			if (values[slots[h]] == v) {
+				return slots[h];
+			}
+		}
+	}
+
+	void grow() {
+		slots.clear();
+		slots.resize(std::max((size_t) 64, 4 * values.size()), -1);
+
+		std::vector<unsigned long long> old;
+		old.swap(values);
+		for (size_t i = 0; i < old.size(); i++) {
+			index(old[i]);
+		}
+	}
+};
+
+// The attributes of a feature: density and count, as included
+void add_tags(output const &o, value_pool &pool, std::vector<uint32_t> &tags, unsigned long long density, unsigned long long count) {
+	uint32_t key = 0;
+	if (o.include_density) {
+		tags.push_back(key++);
+		tags.push_back(pool.index(density));
+	}
+	if (o.include_count) {
+		tags.push_back(key++);
+		tags.push_back(pool.index(count));
+	}
+}
+
+// A ring for a rectangle, or a point at its corner, moving from px, py
+template <bool AS_POINTS>
+void add_geometry(protozero::packed_field_uint32 &geometry, pixel_rect const &r, long long &px, long long &py) {
+	geometry.add_element(protozero::encode_zigzag32(r.x0 - px));
+	geometry.add_element(protozero::encode_zigzag32(r.y0 - py));
+
+	if (AS_POINTS) {
+		px = r.x0;
+		py = r.y0;
+	} else {
+		geometry.add_element(GEOMETRY_COMMAND(mvt_lineto, 3));
+		geometry.add_element(protozero::encode_zigzag32(r.x1 - r.x0));
+		geometry.add_element(protozero::encode_zigzag32(0));
+		geometry.add_element(protozero::encode_zigzag32(0));
+		geometry.add_element(protozero::encode_zigzag32(r.y1 - r.y0));
+		geometry.add_element(protozero::encode_zigzag32(r.x0 - r.x1));
+		geometry.add_element(protozero::encode_zigzag32(0));
+		geometry.add_element(GEOMETRY_COMMAND(mvt_closepath, 1));
+
+		px = r.x0;
+		py = r.y1;
+	}
+}
+
+// The compressed vector tile for the quantized pixels, or empty if there is nothing in it.
+// MODE is OUTPUT_SINGLE or OUTPUT_GROUPED.
+template <int DETAIL, int MODE>
+std::string encode_vector(output const &o, std::vector<unsigned> const &cells, std::vector<long long> const &counts, std::vector<long long> const &normalized, int detail_, quantizer const &q) {
+	size_t detail = fixed_detail<DETAIL>(detail_);
+	int levels = o.levels;
+	value_pool pool;
+	std::vector<uint32_t> tags;  // for all the features, in order
+	size_t tags_per_feature = (o.include_density ? 2 : 0) + (o.include_count ? 2 : 0);
+
+	// Each feature is one pixel, or with grouping, all the rings at one level,
+	// which are start[level] up to start[level + 1] in rects.
+	std::vector<pixel_rect> rects;
+	std::vector<size_t> start;
+	std::vector<long long> feature_levels;
+	bool as_points = o.points;
+
+	if (MODE == OUTPUT_SINGLE) {
+		for (size_t i = 0; i < cells.size(); i++) {
+			if (counts[i] != 0) {
+				add_rect(rects, normalized[i], cells[i] & ((1U << detail) - 1), cells[i] >> detail, (cells[i] & ((1U << detail) - 1)) + 1, (cells[i] >> detail) + 1);
+				add_tags(o, pool, tags, normalized[i], counts[i]);
+			}
+		}
+	} else {
+		std::vector<pixel_rect> unsorted;
+		bool merged = false;
+		if (o.adaptive) {
+			merge_rings<DETAIL>(cells, normalized, detail, unsorted);
+			merged = true;
+
+			// Each feature says whether it is points or polygons, so the
+			// choice can be different in every tile.
+			size_t drawn = 0;
+			for (size_t i = 0; i < normalized.size(); i++) {
+				if (normalized[i] != 0) {
+					drawn++;
+				}
+			}
+
+			if (unsorted.size() * RING_COST >= drawn) {
+				as_points = true;
+				merged = false;
+				unsorted.clear();
+			}
+		}
+		if (!merged) {
+			for (size_t i = 0; i < cells.size(); i++) {
+				if (normalized[i] != 0) {
+					add_rect(unsorted, normalized[i], cells[i] & ((1U << detail) - 1), cells[i] >> detail, (cells[i] & ((1U << detail) - 1)) + 1, (cells[i] >> detail) + 1);
+				}
+			}
+		}
+
+		// Sort the rings by level, keeping their order within each level
+		start.resize(levels + 1, 0);
+		for (size_t i = 0; i < unsorted.size(); i++) {
+			start[unsorted[i].level + 1]++;
+		}
+		for (int i = 0; i < levels; i++) {
+			start[i + 1] += start[i];
+		}
+		rects.resize(unsorted.size());
+		std::vector<size_t> at(start.begin(), start.end() - 1);
+		for (size_t i = 0; i < unsorted.size(); i++) {
+			rects[at[unsorted[i].level]++] = unsorted[i];
+		}
+
+		for (int i = o.first_level; i < levels; i++) {
+			if (start[i + 1] > start[i]) {
+				long long count = q.count(i);
+				if (count < o.first_count) {
+					continue;
+				}
+
+				feature_levels.push_back(i);
+				add_tags(o, pool, tags, i, count);
+			}
+		}
+	}
+
+	size_t features = MODE == OUTPUT_SINGLE ? rects.size() : feature_levels.size();
+	if (features == 0) {
+		return "";
+	}
+
+	std::string data;
+	protozero::pbf_writer writer(data);
+
+	{
+		protozero::pbf_writer layer_writer(writer, 3);
+
+		layer_writer.add_uint32(15, 2);        /* version */
+		layer_writer.add_string(1, o.layername);  /* name */
+		layer_writer.add_uint32(5, 1U << detail); /* extent */
+
+		if (o.include_density) {
+			layer_writer.add_string(3, "density"); /* key */
+		}
+		if (o.include_count) {
+			layer_writer.add_string(3, "count"); /* key */
+		}
+
+		for (size_t v = 0; v < pool.values.size(); v++) {
+			protozero::pbf_writer value_writer(layer_writer, 4);
+			value_writer.add_uint64(5, pool.values[v]);
+		}
+
+		for (size_t f = 0; f < features; f++) {
+			protozero::pbf_writer feature_writer(layer_writer, 2);
+
+			feature_writer.add_enum(3, as_points ? mvt_point : mvt_polygon);
+			feature_writer.add_packed_uint32(2, tags.begin() + f * tags_per_feature, tags.begin() + (f + 1) * tags_per_feature);
+
+			size_t first = f, last = f + 1;
+			if (MODE != OUTPUT_SINGLE) {
+				first = start[feature_levels[f]];
+				last = start[feature_levels[f] + 1];
+			}
+
+			protozero::packed_field_uint32 geometry(feature_writer, 4);
+			long long px = 0, py = 0;
+
+			if (as_points) {
+				geometry.add_element(GEOMETRY_COMMAND(mvt_moveto, last - first));
+				for (size_t i = first; i < last; i++) {
+					add_geometry<true>(geometry, rects[i], px, py);
+				}
+			} else {
+				for (size_t i = first; i < last; i++) {
+					geometry.add_element(GEOMETRY_COMMAND(mvt_moveto, 1));
+					add_geometry<false>(geometry, rects[i], px, py);
+				}
+			}
+		}
+	}
+
+	std::string compressed;
+	compress_tile(data, compressed, true);
+	return compressed;
+}
+
+// With -K, aim for this fraction of the maximum tile size, to leave room for
+// the estimate being off, and for this smaller fraction if the tile was
+// still too big with the first estimate
+#define THRESHOLD_TARGET 0.95
+#define THRESHOLD_FALLBACK_TARGET 0.8
+
+// With -K, a tile is encoded at most this many times: as usual, with the
+// threshold from the first estimate, and with the fallback one. If it is
+// still too big after that, it is treated like any other oversized tile.
+#define MAX_THRESHOLD_ATTEMPTS 3
+
+// The threshold for an oversized tile. drawn_counts are the sorted counts of
+// the pixels that were drawn at first, and sizes are the number of pixels
+// drawn and the compressed size of each attempt so far. The size of a tile
+// is estimated as a power of the number of pixels in it, fitted to the last
+// two attempts, or in proportion to it if there has only been one. The power
+// is kept between MIN_SIZE_POWER and 1, since compression and the fixed cost
+// of the tile make fewer pixels cost more each, but never make the size
+// shrink faster than the pixels do.
+#define MIN_SIZE_POWER 0.25
+
+long long predict_threshold(std::vector<long long> const &drawn_counts, std::vector<std::pair<size_t, size_t>> const &sizes, double target) {
+	double last_drawn = sizes.back().first;
+	double last_size = sizes.back().second;
+
+	double power = 1;
+	if (sizes.size() >= 2) {
+		double before_drawn = sizes[sizes.size() - 2].first;
+		double before_size = sizes[sizes.size() - 2].second;
+
+		if (before_drawn > last_drawn && before_size > last_size) {
+			power = log(before_size / last_size) / log(before_drawn / last_drawn);
+		}
+		power = std::max(MIN_SIZE_POWER, std::min(1.0, power));
+	}
+
+	// Binary search for the lowest threshold whose pixels are estimated
+	// to fit. Only the counts of drawn pixels are tried, so all the pixels
+	// with the same count are kept or dropped together, and the last
+	// one, past the highest count, drops them all.
+	size_t lo = 0, hi = drawn_counts.size();
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		size_t keep = drawn_counts.end() - std::lower_bound(drawn_counts.begin(), drawn_counts.end(), drawn_counts[mid]);
+
+		// at least one fewer pixel than last time, so that it always shrinks
+		if (keep < last_drawn && last_size * pow(keep / last_drawn, power) <= target) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+
+	if (lo == drawn_counts.size()) {
+		return drawn_counts.back() + 1;
+	}
+	return drawn_counts[lo];
+}
+
+// The compressed tile for an output from the nonzero pixels of a tile and
+// their counts, or empty if there is nothing in it
+std::string encode_tile(output &o, tile const &otile, std::vector<unsigned> const &cells, std::vector<long long> const &raw, int z, int detail, long long zoom_max) {
+	long long thresh = o.first_count;
+	bool again = true;
+
+	std::string compressed;
+	std::string key;
+
+	// for -K
+	std::vector<long long> drawn_counts;
+	std::vector<std::pair<size_t, size_t>> sizes;
+
+	std::vector<long long> counts;
+	std::vector<long long> normalized;
+	counts.resize(cells.size());
+	normalized.resize(cells.size());
+
+	quantizer local;
+	quantizer const *q = &local;
+	if ((size_t) z < o.quantizers.size() && o.quantizers[z].matches(o.levels, o.count_gamma, zoom_max)) {
+		q = &o.quantizers[z];
+	} else {
+		local = quantizer(o.levels, o.count_gamma, zoom_max, o.first_level);
+	}
+
+	while (again) {
+		again = false;
+
+		compressed = "";
+
+		long long min_count = std::max((long long) o.first_count, thresh);
+		size_t drawn = quantize(*q, raw.data(), counts.data(), normalized.data(), cells.size(), min_count, o.first_level);
+
+		// Raising the threshold depends on the size of the tile, not only on its pixels
+		if (o.dedup && !o.increment_threshold) {
+			key = blob_key(o, cells, counts, normalized, detail, zoom_max);
+			if (key.size() > 0 && find_blob(o, key, compressed)) {
+				return compressed;
+			}
+		}
+
+		if (o.mode == OUTPUT_PNG && drawn == 0) {
+			return "";
+		}
+		compressed = kernels_for(detail).encode[o.mode](o, cells, counts, normalized, detail, *q);
+
+		if (compressed.size() == 0) {
+			return compressed;
+		}
+
+		if (compressed.size() > MAX_TILE_SIZE && o.increment_threshold && sizes.size() + 1 < MAX_THRESHOLD_ATTEMPTS) {
+			if (drawn_counts.size() == 0) {
+				for (size_t i = 0; i < counts.size(); i++) {
+					if (o.mode != OUTPUT_SINGLE ? normalized[i] != 0 : counts[i] != 0) {
+						drawn_counts.push_back(counts[i]);
+					}
+				}
+				std::sort(drawn_counts.begin(), drawn_counts.end());
+			}
+
+			size_t drawn_now = drawn_counts.end() - std::lower_bound(drawn_counts.begin(), drawn_counts.end(), min_count);
+			sizes.push_back(std::pair<size_t, size_t>(drawn_now, compressed.size()));
+			thresh = predict_threshold(drawn_counts, sizes, MAX_TILE_SIZE * (sizes.size() == 1 ? THRESHOLD_TARGET : THRESHOLD_FALLBACK_TARGET));
+
+			fprintf(stderr, "Raising threshold to %lld for %zu bytes in tile %d/%lld/%lld\n", thresh, compressed.size(), z, otile.x, otile.y);
+			again = true;
+			continue;
+		}
+
+		if (o.limit_tile_sizes && compressed.size() > MAX_TILE_SIZE) {
+			if (o.increment_threshold) {
+				fprintf(stderr, "Tile %d/%lld/%lld is still too big with threshold %lld: %zu\n", z, otile.x, otile.y, thresh, compressed.size());
+			} else {
+				fprintf(stderr, "Tile is too big: %zu\n", compressed.size());
+			}
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (key.size() > 0) {
+		store_blob(o, key, compressed);
+	}
+
+	return compressed;
+}
+
+// Tiles are written to the output by threads of their own, each of which
+// is the only one that touches its part of the output, so that encoding
+// never waits for it. Encoded tiles are pushed onto a lock-free list, and the writer
+// takes the whole list at once. Locks are only needed when the writer has
+// nothing to do and goes to sleep, or when the list has grown so big that
+// the encoders have to wait for it.
+
+struct encoded_tile {
+	int z;
+	long long x;
+	long long y;
+	std::string data;
+	std::string id;  // with dedup
+	encoded_tile *next;
+
+	// In the order of the mbtiles index: zoom, column, then TMS row
+	bool operator<(encoded_tile const &o) const {
+		if (z < o.z) {
+			return true;
+		}
+		if (z == o.z) {
+			if (x < o.x) {
+				return true;
+			}
+			if (x == o.x) {
+				if (y > o.y) {
+					return true;
+				}
+			}
+		}
+
+		return false;
+	}
+};
+
+static bool encoded_less(encoded_tile const *a, encoded_tile const *b) {
+	return *a < *b;
+}
+
+#define WRITE_QUEUE_BYTES (64 * 1024 * 1024)
+
+// For ordered output, tiles beyond this are sorted and spilled to a
+// temporary file, and the spilled runs are merged at the end
+#define ORDER_BUFFER_BYTES (64 * 1024 * 1024)
+
+struct tile_writer {
+	tile_sink *sink;
+	bool dedup;
+
+	bool ordered;
+	std::vector<encoded_tile *> pending;
+	size_t pending_bytes;
+	FILE *spill;
+	std::vector<std::pair<off_t, size_t>> runs;  // offset and number of tiles
+
+	std::atomic<encoded_tile *> head;  // most recently queued first
+	std::atomic<size_t> queued;        // bytes
+	std::atomic<bool> sleeping;        // writer waiting for tiles
+	std::atomic<size_t> waiting;       // encoders waiting for room
+	std::atomic<bool> done;
+
+	pthread_mutex_t lock;
+	pthread_cond_t ready;  // something queued, or done
+	pthread_cond_t room;   // queue below the limit
+	pthread_t thread;
+};
+
+// Each spilled tile is its zoom, column, row, length, and ID length,
+// followed by its data and ID
+
+void spill_pending(tile_writer *w) {
+	if (w->spill == NULL) {
+		w->spill = tmpfile();
+		if (w->spill == NULL) {
+			perror("tmpfile for ordered tiles");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	std::sort(w->pending.begin(), w->pending.end(), encoded_less);
+
+	if (fseeko(w->spill, 0, SEEK_END) != 0) {
+		perror("fseeko ordered tiles");
+		exit(EXIT_FAILURE);
+	}
+	w->runs.push_back(std::pair<off_t, size_t>(ftello(w->spill), w->pending.size()));
+
+	for (size_t i = 0; i < w->pending.size(); i++) {
+		encoded_tile *et = w->pending[i];
+		long long header[5] = {et->z, et->x, et->y, (long long) et->data.size(), (long long) et->id.size()};
+
+		if (fwrite(header, sizeof(header), 1, w->spill) != 1 ||
+		    fwrite(et->data.data(), sizeof(char), et->data.size(), w->spill) != et->data.size() ||
+		    fwrite(et->id.data(), sizeof(char), et->id.size(), w->spill) != et->id.size()) {
+			perror("fwrite ordered tiles");
+			exit(EXIT_FAILURE);
+		}
+
+		delete et;
+	}
+
+	w->pending.clear();
+	w->pending_bytes = 0;
+}
+
+struct spilled_run {
+	encoded_tile head;
+	off_t off;
+	size_t left;
+
+	// Backwards because priority_queue puts highest first
+	bool operator<(spilled_run const &o) const {
+		return o.head < head;
+	}
+};
+
+bool read_spilled(tile_writer *w, spilled_run &r) {
+	if (r.left == 0) {
+		return false;
+	}
+
+	if (fseeko(w->spill, r.off, SEEK_SET) != 0) {
+		perror("fseeko ordered tiles");
+		exit(EXIT_FAILURE);
+	}
+
+	long long header[5];
+	if (fread(header, sizeof(header), 1, w->spill) != 1) {
+		perror("fread ordered tiles");
+		exit(EXIT_FAILURE);
+	}
+
+	r.head.z = header[0];
+	r.head.x = header[1];
+	r.head.y = header[2];
+	r.head.data.resize(header[3]);
+	if (header[3] > 0 && fread(&r.head.data[0], sizeof(char), header[3], w->spill) != (size_t) header[3]) {
+		perror("fread ordered tiles");
+		exit(EXIT_FAILURE);
+	}
+	r.head.id.resize(header[4]);
+	if (header[4] > 0 && fread(&r.head.id[0], sizeof(char), header[4], w->spill) != (size_t) header[4]) {
+		perror("fread ordered tiles");
+		exit(EXIT_FAILURE);
+	}
+
+	r.off = ftello(w->spill);
+	r.left--;
+	return true;
+}
+
+// Write out the tiles held back for ordered output, merging the spilled runs
+
+void write_pending(tile_writer *w) {
+	if (w->runs.size() == 0) {
+		std::sort(w->pending.begin(), w->pending.end(), encoded_less);
+
+		for (size_t i = 0; i < w->pending.size(); i++) {
+			w->sink->write_tile(w->pending[i]->z, w->pending[i]->x, w->pending[i]->y, w->pending[i]->data, w->pending[i]->id);
+			delete w->pending[i];
+		}
+
+		w->pending.clear();
+		return;
+	}
+
+	spill_pending(w);
+
+	std::priority_queue<spilled_run> q;
+	for (size_t i = 0; i < w->runs.size(); i++) {
+		spilled_run r;
+		r.off = w->runs[i].first;
+		r.left = w->runs[i].second;
+
+		if (read_spilled(w, r)) {
+			q.push(r);
+		}
+	}
+
+	while (q.size() > 0) {
+		spilled_run r = q.top();
+		q.pop();
+
+		w->sink->write_tile(r.head.z, r.head.x, r.head.y, r.head.data, r.head.id);
+
+		if (read_spilled(w, r)) {
+			q.push(r);
+		}
+	}
+
+	fclose(w->spill);
+	w->spill = NULL;
+	w->runs.clear();
+}
+
+void *run_writer(void *p) {
+	tile_writer *w = (tile_writer *) p;
+
+	while (true) {
+		encoded_tile *list = w->head.exchange(NULL);
+
+		if (list == NULL) {
+			if (pthread_mutex_lock(&w->lock) != 0) {
+				perror("pthread_mutex_lock");
+				exit(EXIT_FAILURE);
+			}
+
+			w->sleeping = true;
+			while (w->head.load() == NULL && !w->done) {
+				pthread_cond_wait(&w->ready, &w->lock);
+			}
+			w->sleeping = false;
+
+			if (pthread_mutex_unlock(&w->lock) != 0) {
+				perror("pthread_mutex_unlock");
+				exit(EXIT_FAILURE);
+			}
+
+			if (w->head.load() == NULL) {
+				break;
+			}
+
+			continue;
+		}
+
+		// The list is newest first, so reverse it to write in order
+
+		encoded_tile *fifo = NULL;
+		while (list != NULL) {
+			encoded_tile *next = list->next;
+			list->next = fifo;
+			fifo = list;
+			list = next;
+		}
+
+		size_t written = 0;
+		while (fifo != NULL) {
+			encoded_tile *et = fifo;
+			fifo = et->next;
+			written += et->data.size();
+
+			if (w->ordered) {
+				w->pending.push_back(et);
+				w->pending_bytes += et->data.size();
+
+				if (w->pending_bytes >= ORDER_BUFFER_BYTES) {
+					spill_pending(w);
+				}
+			} else {
+				w->sink->write_tile(et->z, et->x, et->y, et->data, et->id);
+				delete et;
+			}
+		}
+
+		w->queued -= written;
+		if (w->waiting.load() > 0) {
+			if (pthread_mutex_lock(&w->lock) != 0) {
+				perror("pthread_mutex_lock");
+				exit(EXIT_FAILURE);
+			}
+
+			pthread_cond_broadcast(&w->room);
+
+			if (pthread_mutex_unlock(&w->lock) != 0) {
+				perror("pthread_mutex_unlock");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (w->ordered) {
+		write_pending(w);
+	}
+
+	w->sink->flush();
+
+	return NULL;
+}
+
+// If ordered, tiles are written in index order instead of as they come
+
+void writer_start(tile_writer *w, tile_sink *sink, bool ordered, bool dedup) {
+	w->sink = sink;
+	w->dedup = dedup;
+	w->ordered = ordered;
+	w->pending_bytes = 0;
+	w->spill = NULL;
+	w->head = NULL;
+	w->queued = 0;
+	w->sleeping = false;
+	w->waiting = 0;
+	w->done = false;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->ready, NULL);
+	pthread_cond_init(&w->room, NULL);
+
+	if (pthread_create(&w->thread, NULL, run_writer, w) != 0) {
+		perror("pthread_create");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void wake_writer(tile_writer *w) {
+	if (pthread_mutex_lock(&w->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_cond_signal(&w->ready);
+
+	if (pthread_mutex_unlock(&w->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Queue a tile to be written, taking its data
+void write_tile(tile_writer *w, int z, long long x, long long y, std::string &data) {
+	if (data.size() == 0) {
+		return;
+	}
+
+	if (w->queued.load() >= WRITE_QUEUE_BYTES) {
+		if (pthread_mutex_lock(&w->lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_FAILURE);
+		}
+
+		w->waiting++;
+		while (w->queued.load() >= WRITE_QUEUE_BYTES) {
+			pthread_cond_wait(&w->room, &w->lock);
+		}
+		w->waiting--;
+
+		if (pthread_mutex_unlock(&w->lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	encoded_tile *et = new encoded_tile;
+	et->z = z;
+	et->x = x;
+	et->y = y;
+	et->data.swap(data);
+	if (w->dedup) {
+		// Here rather than in the writer thread, so that it happens in parallel
+		et->id = tile_id(et->data);
+	}
+	w->queued += et->data.size();
+
+	et->next = w->head.load();
+	while (!w->head.compare_exchange_weak(et->next, et)) {
+	}
+
+	if (w->sleeping.load()) {
+		wake_writer(w);
+	}
+}
+
+// Encode a tile for each of the outputs, and write it to each one's
+// writer for the specified shard
+void make_tiles(size_t shard, tile &otile, int detail, long long zoom_max) {
+	std::vector<unsigned> cells;
+	std::vector<long long> raw;
+	kernels_for(detail).pixels(otile, cells, raw);
+
+	for (size_t i = 0; i < outputs.size(); i++) {
+		output &o = *outputs[i];
+
+		std::string compressed = encode_tile(o, otile, cells, raw, otile.z, detail, zoom_max);
+		write_tile(o.writers[shard % o.writers.size()], otile.z, otile.x, otile.y, compressed);
+	}
+}
+
+// Write whatever is still queued and stop the writer thread
+void writer_finish(tile_writer *w) {
+	w->done = true;
+	wake_writer(w);
+
+	void *retval;
+	if (pthread_join(w->thread, &retval) != 0) {
+		perror("pthread_join");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_cond_destroy(&w->room);
+	pthread_cond_destroy(&w->ready);
+	pthread_mutex_destroy(&w->lock);
+}
+
+// Completed tiles are encoded by a pool of threads separate from the ones
+// accumulating them from the input. The accumulating thread swaps the counts
+// of each completed tile into a spare tile from the pool, and goes on with
+// the spare's (already cleared) counts, so there are only ever as many tile
+// grids waiting to be encoded as the pool has spares. When there are none
+// free, the accumulating thread waits for an encoder to finish with one.
+
+#define SPARES_PER_ENCODER 2
+
+struct encoder_pool {
+	std::vector<tile *> spares;  // free ones
+	size_t outstanding;          // spares in use
+	size_t limit;
+	std::deque<tile *> queue;
+	bool done;
+
+	std::vector<long long> zoom_max;
+	std::atomic<size_t> started;  // for choosing each encoder's shard of the outputs
+
+	pthread_mutex_t lock;
+	pthread_cond_t ready;  // something in the queue, or done
+	pthread_cond_t room;   // a spare is free
+	std::vector<pthread_t> threads;
+};
+
+void *run_encoder(void *p) {
+	encoder_pool *e = (encoder_pool *) p;
+	size_t shard = e->started++;
+
+	if (pthread_mutex_lock(&e->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+
+	while (true) {
+		while (e->queue.size() == 0 && !e->done) {
+			pthread_cond_wait(&e->ready, &e->lock);
+		}
+		if (e->queue.size() == 0) {
+			break;
+		}
+
+		tile *tl = e->queue.front();
+		e->queue.pop_front();
+
+		if (pthread_mutex_unlock(&e->lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
+
+		make_tiles(shard, *tl, tl->detail, e->zoom_max[tl->z]);
+		tl->clear();
+
+		if (pthread_mutex_lock(&e->lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_FAILURE);
+		}
+
+		e->spares.push_back(tl);
+		e->outstanding--;
+		pthread_cond_signal(&e->room);
+	}
+
+	if (pthread_mutex_unlock(&e->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+
+	return NULL;
+}
+
+void encoder_start(encoder_pool *e, size_t threads, std::vector<long long> const &zoom_max) {
+	e->outstanding = 0;
+	e->limit = SPARES_PER_ENCODER * threads;
+	e->done = false;
+	e->zoom_max = zoom_max;
+	e->started = 0;
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_cond_init(&e->ready, NULL);
+	pthread_cond_init(&e->room, NULL);
+
+	e->threads.resize(threads);
+	for (size_t i = 0; i < threads; i++) {
+		if (pthread_create(&e->threads[i], NULL, run_encoder, e) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// Queue a completed tile to be encoded, leaving it cleared
+void encode_later(encoder_pool *e, tile &tl) {
+	if (pthread_mutex_lock(&e->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+
+	while (e->outstanding >= e->limit) {
+		pthread_cond_wait(&e->room, &e->lock);
+	}
+
+	tile *spare;
+	if (e->spares.size() > 0) {
+		spare = e->spares.back();
+		e->spares.pop_back();
+	} else {
+		spare = new tile(tl.detail, tl.z, tl.morton);
+	}
+	e->outstanding++;
+
+	if (pthread_mutex_unlock(&e->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+
+	// Outside the lock, since the spare is nobody else's now.
+	// With a detail schedule, the spare may have last held a tile
+	// of another detail.
+	size_t detail = tl.detail;
+	spare->morton = tl.morton;
+	spare->take(tl);
+	if (tl.detail != detail) {
+		tl.resize(detail);
+	}
+
+	if (pthread_mutex_lock(&e->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+
+	e->queue.push_back(spare);
+	pthread_cond_signal(&e->ready);
+
+	if (pthread_mutex_unlock(&e->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Encode whatever is still queued and stop the encoder threads
+void encoder_finish(encoder_pool *e) {
+	if (pthread_mutex_lock(&e->lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
 
-	FILE *fp;
-	size_t minzoom;
-	size_t zooms;
-	size_t detail;
-	sqlite3 *outdb;
-	int maxzoom;
+	e->done = true;
+	pthread_cond_broadcast(&e->ready);
 
-	volatile int *progress;
-	size_t shard;
-	size_t cpus;
-	std::string layername;
-};
+	if (pthread_mutex_unlock(&e->lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
 
-void gather_quantile(tile const &tile, int detail, long long &max) {
-	for (size_t y = 0; y < (1U << detail); y++) {
-		for (size_t x = 0; x < (1U << detail); x++) {
-			long long count = tile.count[y * (1 << detail) + x];
+	for (size_t i = 0; i < e->threads.size(); i++) {
+		void *retval;
 
-			if (count > max) {
-				max = count;
-			}
+		if (pthread_join(e->threads[i], &retval) != 0) {
+			perror("pthread_join");
+			exit(EXIT_FAILURE);
 		}
 	}
+
+	for (size_t i = 0; i < e->spares.size(); i++) {
+		delete e->spares[i];
+	}
+	e->spares.clear();
+
+	pthread_cond_destroy(&e->room);
+	pthread_cond_destroy(&e->ready);
+	pthread_mutex_destroy(&e->lock);
 }
 
-void string_append(png_structp png_ptr, png_bytep data, png_size_t length) {
-	std::string *s = (std::string *) png_get_io_ptr(png_ptr);
-	s->append(std::string(data, data + length));
+// The range of quadkeys covered by any tile at zoom z, relative to the start of the tile
+static unsigned long long tile_mask(size_t z) {
+	if (z == 0) {
+		return ~0ULL;
+	} else {
+		return (1ULL << (2 * (32 - z))) - 1;
+	}
 }
 
-static void fail(png_structp png_ptr, png_const_charp error_msg) {
-	fprintf(stderr, "PNG error %s\n", error_msg);
-	exit(EXIT_FAILURE);
+unsigned long long read_index(record_file *input, size_t record) {
+	unsigned char buf[INDEX_BYTES];
+	read_bytes(input, record * RECORD_BYTES + HEADER_LEN, INDEX_BYTES, buf);
+	return read64(buf);
 }
 
-void make_tile(sqlite3 *outdb, tile &otile, int z, int detail, long long zoom_max, std::string const &layername) {
-	long long thresh = first_count;
-	bool again = true;
-	tile tile = otile;
+// The first record between lo and hi whose index is greater than the specified one
+size_t upper_record(record_file *input, size_t lo, size_t hi, unsigned long long index) {
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
 
-	std::string compressed;
+		if (read_index(input, mid) > index) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
 
-	while (again) {
-		again = false;
+	return lo;
+}
 
-		compressed = "";
-		tile = otile;
+// Choose the zoom level whose tiles the input is divided at, the lowest one
+// that has enough tiles with data in them to keep all the threads busy, and
+// cut the input into about that many tasks, each of which is made of whole
+// tiles at that zoom. Tiles at and above the split zoom are then always
+// completed within a single task.
 
-		std::vector<long long> normalized;
-		normalized.resize(tile.count.size());
+void plan_tasks(record_file *input, size_t records, size_t lowzoom, size_t topzoom, size_t cpus, size_t &splitzoom, std::vector<task> &tasks) {
+	size_t want = TASKS_PER_CPU * cpus;
 
-		for (size_t y = 0; y < (1U << detail); y++) {
-			for (size_t x = 0; x < (1U << detail); x++) {
-				long long count = tile.count[y * (1 << detail) + x];
-				long long density = 0;
+	splitzoom = topzoom;
+	for (size_t z = lowzoom; z <= topzoom; z++) {
+		size_t n = 0;
 
-				if (count > 0 && (count < first_count || count < thresh)) {
-					count = 0;
-					tile.count[y * (1 << detail) + x] = 0;
-				}
+		for (size_t r = 0; r < records && n < want; n++) {
+			r = upper_record(input, r, records, read_index(input, r) | tile_mask(z));
+		}
+
+		if (n >= want) {
+			splitzoom = z;
+			break;
+		}
+	}
 
-				if (count > 0) {
-					density = exp(log(exp(log(levels) * count_gamma) * count / zoom_max) / count_gamma);
+	size_t chunk = records / want;
+	if (chunk < 1) {
+		chunk = 1;
+	}
 
-					if (density < first_level) {
-						density = 0;
-						count = 0;
-						tile.count[y * (1 << detail) + x] = 0;
-					}
-				}
-				if (density > levels - 1) {
-					density = levels - 1;
-				}
+	tasks.clear();
+	for (size_t r = 0; r < records;) {
+		size_t end = r + chunk;
 
-				normalized[y * (1 << detail) + x] = density;
-			}
+		if (end >= records) {
+			end = records;
+		} else {
+			end = upper_record(input, end - 1, records, read_index(input, end - 1) | tile_mask(splitzoom));
 		}
 
-		if (bitmap) {
-			bool anything = false;
-			for (size_t y = 0; y < 1U << detail; y++) {
-				for (size_t x = 0; x < (1U << detail); x++) {
-					long long density = normalized[y * (1 << detail) + x];
-					if (density > 0) {
-						anything = true;
-					}
-				}
-			}
-			if (!anything) {
-				return;
-			}
+		task tk;
+		tk.start = r;
+		tk.end = end;
+		tasks.push_back(tk);
 
-			unsigned char *rows[1U << detail];
-			for (size_t y = 0; y < 1U << detail; y++) {
-				rows[y] = new unsigned char[1U << detail];
+		r = end;
+	}
+}
 
-				for (size_t x = 0; x < (1U << detail); x++) {
-					long long density = normalized[y * (1 << detail) + x];
-					rows[y][x] = density;
-				}
-			}
+// Tiles below the split zoom are assembled from the tiles at the split zoom
+// from many tasks, each of which adds its counts into its own quadrant.
 
-			png_structp png_ptr;
-			png_infop info_ptr;
+shared_tile *find_shared(tiling_state *state, size_t z, long long x, long long y) {
+	if (pthread_mutex_lock(&state->shared_lock) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
 
-			png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, fail, fail);
-			if (png_ptr == NULL) {
-				fprintf(stderr, "PNG failure (write struct)\n");
-				exit(EXIT_FAILURE);
+	std::pair<long long, long long> key(x, y);
+	auto f = state->shared[z].find(key);
+	shared_tile *st;
+
+	if (f == state->shared[z].end()) {
+		st = new shared_tile(state->details[z], z);
+		st->tl.x = x;
+		st->tl.y = y;
+		st->tl.active = true;
+		state->shared[z].insert(std::pair<std::pair<long long, long long>, shared_tile *>(key, st));
+	} else {
+		st = f->second;
+	}
+
+	if (pthread_mutex_unlock(&state->shared_lock) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+
+	return st;
+}
+
+// Leaves the tile cleared on the second pass, so it must already have been
+// reduced into its parent.
+
+void keep_tile(tiler *t, tile const &tl);
+
+void finish_tile(tiler *t, tile &tile) {
+	if (t->pass == 0) {
+		if ((long long) tile.max > t->max[tile.z]) {
+			t->max[tile.z] = tile.max;
+		}
+
+		if (t->keeping != NULL) {
+			keep_tile(t, tile);
+		}
+	} else {
+		encode_later(t->encoders, tile);
+	}
+}
+
+// Each parent pixel in the quadrant is the sum of a 2x2 block of child pixels.
+// In Z-order, the quadrant is a contiguous quarter of the parent, and each
+// 2x2 block of the child is four consecutive pixels.
+
+template <int DETAIL, typename P, typename C>
+void reduce_dense(tile &parent, std::vector<P> &pcount, tile const &child, std::vector<C> const &ccount) {
+	size_t dim = 1U << fixed_detail<DETAIL>(child.detail);
+	unsigned long long max = parent.max;
+
+	if (child.morton) {
+		size_t quarter = dim * dim / 4;
+		P *out = &pcount[(((child.y & 1) << 1) | (child.x & 1)) * quarter];
+		C const *in = &ccount[0];
+
+		for (size_t i = 0; i < quarter; i++) {
+			unsigned long long v = (unsigned long long) out[i] + in[4 * i] + in[4 * i + 1] + in[4 * i + 2] + in[4 * i + 3];
+			out[i] = v;
+			if (v > max) {
+				max = v;
 			}
-			info_ptr = png_create_info_struct(png_ptr);
-			if (info_ptr == NULL) {
-				png_destroy_write_struct(&png_ptr, NULL);
-				fprintf(stderr, "PNG failure (info struct)\n");
-				exit(EXIT_FAILURE);
-			} else {
-				png_set_IHDR(png_ptr, info_ptr, 1U << detail, 1U << detail, 8, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-
-				png_byte transparency[levels];
-				png_color colors[levels];
-				for (int i = 0; i < levels / 2; i++) {
-					colors[i].red = (color >> 16) & 0xFF;
-					colors[i].green = (color >> 8) & 0xFF;
-					colors[i].blue = (color >> 0) & 0xFF;
-					transparency[i] = 255 * i / (levels / 2);
-				}
-				for (int i = levels / 2; i < levels; i++) {
-					double along = 255 * (i - levels / 2) / (levels - levels / 2 - 1) / 255.0;
-					int fg = white ? 0x00 : 0xFF;
-
-					colors[i].red = ((color >> 16) & 0xFF) * (1 - along) + fg * (along);
-					colors[i].green = ((color >> 8) & 0xFF) * (1 - along) + fg * (along);
-					colors[i].blue = ((color >> 0) & 0xFF) * (1 - along) + fg * (along);
-					transparency[i] = 255;
+		}
+	} else {
+		size_t half = dim / 2;
+		size_t xoff = (child.x & 1) * half;
+		size_t yoff = (child.y & 1) * half;
+
+		for (size_t y = 0; y < half; y++) {
+			P *out = &pcount[(yoff + y) * dim + xoff];
+			C const *in1 = &ccount[(2 * y) * dim];
+			C const *in2 = &ccount[(2 * y + 1) * dim];
+
+			for (size_t x = 0; x < half; x++) {
+				unsigned long long v = (unsigned long long) out[x] + in1[2 * x] + in1[2 * x + 1] + in2[2 * x] + in2[2 * x + 1];
+				out[x] = v;
+				if (v > max) {
+					max = v;
 				}
-				png_set_tRNS(png_ptr, info_ptr, transparency, levels, NULL);
-				png_set_PLTE(png_ptr, info_ptr, colors, levels);
-
-				png_set_rows(png_ptr, info_ptr, rows);
-				png_set_write_fn(png_ptr, &compressed, string_append, NULL);
-				png_write_png(png_ptr, info_ptr, 0, NULL);
-				png_write_end(png_ptr, info_ptr);
-				png_destroy_info_struct(png_ptr, &info_ptr);
-				png_destroy_write_struct(&png_ptr, &info_ptr);
 			}
+		}
+	}
 
-			for (size_t i = 0; i < 1U << detail; i++) {
-				delete[] rows[i];
-			}
-		} else {
-			mvt_layer layer;
-			layer.name = layername;
-			layer.version = 2;
-			layer.extent = 1U << detail;
-
-			std::vector<mvt_feature> features;
-			features.resize(levels);
-
-			if (single_polygons) {
-				for (size_t y = 0; y < (1U << detail); y++) {
-					for (size_t x = 0; x < (1U << detail); x++) {
-						if (tile.count[y * (1 << detail) + x] != 0) {
-							mvt_feature feature;
-							if (points) {
-								feature.type = mvt_point;
-							} else {
-								feature.type = mvt_polygon;
-							}
+	parent.max = max;
+}
 
-							feature.geometry.push_back(mvt_geometry(mvt_moveto, x, y));
+template <int DETAIL, typename C>
+void reduce_dense(tile &parent, tile const &child, std::vector<C> const &ccount) {
+	if (parent.bits == 16) {
+		reduce_dense<DETAIL>(parent, parent.count16, child, ccount);
+	} else if (parent.bits == 32) {
+		reduce_dense<DETAIL>(parent, parent.count32, child, ccount);
+	} else {
+		reduce_dense<DETAIL>(parent, parent.count64, child, ccount);
+	}
+}
 
-							if (!points) {
-								feature.geometry.push_back(mvt_geometry(mvt_lineto, (x + 1), (y + 0)));
-								feature.geometry.push_back(mvt_geometry(mvt_lineto, (x + 1), (y + 1)));
-								feature.geometry.push_back(mvt_geometry(mvt_lineto, (x + 0), (y + 1)));
-								feature.geometry.push_back(mvt_geometry(mvt_closepath, 0, 0));
-							}
+// With a detail schedule, the parent can have a lower detail than the child,
+// so that each of its pixels is the sum of a larger block of child pixels,
+// or one more, so that each is the same as one child pixel.
 
-							if (include_density) {
-								mvt_value val;
-								val.type = mvt_uint;
-								val.numeric_value.uint_value = normalized[y * (1 << detail) + x];
-								layer.tag(feature, "density", val);
-							}
+void reduce_rescaled(tile &parent, tile const &child) {
+	size_t shift = child.detail + 1 - parent.detail;
+	size_t half = parent.detail > 0 ? 1U << (parent.detail - 1) : 0;
+	size_t xoff = (child.x & 1) * half;
+	size_t yoff = (child.y & 1) * half;
 
-							if (include_count) {
-								mvt_value val;
-								val.type = mvt_uint;
-								val.numeric_value.uint_value = tile.count[y * (1 << detail) + x];
-								layer.tag(feature, "count", val);
-							}
+	std::vector<unsigned> cells;
+	std::vector<long long> counts;
+	child.nonzero<ANY_DETAIL>(cells);
+	child.values<ANY_DETAIL>(cells, counts);
 
-							layer.features.push_back(feature);
-						}
-					}
-				}
-			} else {
-				for (size_t y = 0; y < (1U << detail); y++) {
-					for (size_t x = 0; x < (1U << detail); x++) {
-						long long density = normalized[y * (1 << detail) + x];
-						if (density != 0) {
-							mvt_feature &feature = features[density];
-							if (points) {
-								feature.type = mvt_point;
-							} else {
-								feature.type = mvt_polygon;
-							}
+	for (size_t i = 0; i < cells.size(); i++) {
+		size_t x = cells[i] & ((1U << child.detail) - 1);
+		size_t y = cells[i] >> child.detail;
 
-							feature.geometry.push_back(mvt_geometry(mvt_moveto, x, y));
+		parent.add(parent.index(xoff + (x >> shift), yoff + (y >> shift)), counts[i]);
+	}
+}
 
-							if (!points) {
-								feature.geometry.push_back(mvt_geometry(mvt_lineto, (x + 1), (y + 0)));
-								feature.geometry.push_back(mvt_geometry(mvt_lineto, (x + 1), (y + 1)));
-								feature.geometry.push_back(mvt_geometry(mvt_lineto, (x + 0), (y + 1)));
-								feature.geometry.push_back(mvt_geometry(mvt_closepath, 0, 0));
-							}
-						}
-					}
-				}
+// Add the counts from a completed tile into the quadrant of its parent
+// tile that it covers.
 
-				for (size_t i = first_level; i < features.size(); i++) {
-					if (features[i].geometry.size() != 0) {
-						// features[i].geometry = merge_rings(features[i].geometry);
+template <int DETAIL>
+void reduce_into(tile &parent, tile const &child) {
+	size_t detail = fixed_detail<DETAIL>(child.detail);
+	size_t dim = 1U << detail;
 
-						long long count = ceil(exp(log(i) * count_gamma) * zoom_max / exp(log(levels) * count_gamma));
-						if (count < first_count) {
-							continue;
-						}
+	if (parent.detail != detail) {
+		reduce_rescaled(parent, child);
+		return;
+	}
 
-						if (include_density) {
-							mvt_value val;
-							val.type = mvt_uint;
-							val.numeric_value.uint_value = i;
-							layer.tag(features[i], "density", val);
-						}
+	if (detail == 0) {
+		parent.add(0, child.get(0));
+		return;
+	}
 
-						if (include_count) {
-							mvt_value val;
-							val.type = mvt_uint;
-							val.numeric_value.uint_value = count;
-							layer.tag(features[i], "count", val);
-						}
+	if (!child.dense) {
+		size_t half = dim / 2;
+		size_t xoff = (child.x & 1) * half;
+		size_t yoff = (child.y & 1) * half;
+		size_t quarter = dim * dim / 4;
+		size_t off = (((child.y & 1) << 1) | (child.x & 1)) * quarter;
 
-						layer.features.push_back(features[i]);
-					}
-				}
-			}
+		for (size_t i = 0; i < child.touched.size(); i++) {
+			size_t pixel = child.touched[i];
 
-			if (layer.features.size() > 0) {
-				mvt_tile mvt;
-				mvt.layers.push_back(layer);
+			if (child.morton) {
+				parent.add(off + (pixel >> 2), child.get(pixel));
+			} else {
+				size_t x = (pixel & (dim - 1)) >> 1;
+				size_t y = pixel >> (detail + 1);
 
-				compressed = mvt.encode();
+				parent.add((yoff + y) * dim + xoff + x, child.get(pixel));
 			}
 		}
 
-		if (compressed.size() == 0) {
-			return;
-		}
+		return;
+	}
 
-		if (compressed.size() > MAX_TILE_SIZE && increment_threshold) {
-			std::vector<long long> vals;
-			for (size_t i = 0; i < tile.count.size(); i++) {
-				if (tile.count[i] > 0) {
-					vals.push_back(tile.count[i]);
-				}
-			}
-			std::sort(vals.begin(), vals.end());
-			ssize_t n = ceil(vals.size() - vals.size() * MAX_TILE_SIZE / compressed.size() * 0.95);
-			if (n >= (ssize_t) vals.size()) {
-				n = vals.size() - 1;
-			}
-			if (n < 0) {
-				n = 0;
-			}
-			thresh = vals[n] + 1;
+	// The quadrant was empty before, so four times the child's largest
+	// count is the most that any of its pixels can end up with.
 
-			fprintf(stderr, "Raising threshold to %lld for %zu bytes in tile %d/%lld/%lld\n", thresh, compressed.size(), z, tile.x, tile.y);
-			again = true;
-			continue;
-		}
+	parent.make_dense();
+	parent.widen(parent.max + 4 * child.max);
 
-		if (limit_tile_sizes && compressed.size() > MAX_TILE_SIZE) {
-			fprintf(stderr, "Tile is too big: %zu\n", compressed.size());
-			exit(EXIT_FAILURE);
-		}
+	if (child.bits == 16) {
+		reduce_dense<DETAIL>(parent, child, child.count16);
+	} else if (child.bits == 32) {
+		reduce_dense<DETAIL>(parent, child, child.count32);
+	} else {
+		reduce_dense<DETAIL>(parent, child, child.count64);
 	}
+}
 
-	static pthread_mutex_t db_lock = PTHREAD_MUTEX_INITIALIZER;
+void reduce_shared(tiler *t, tile const &child) {
+	shared_tile *st = find_shared(t->state, child.z - 1, child.x >> 1, child.y >> 1);
 
-	if (pthread_mutex_lock(&db_lock) != 0) {
+	if (pthread_mutex_lock(&st->lock) != 0) {
 		perror("pthread_mutex_lock");
 		exit(EXIT_FAILURE);
 	}
 
-	mbtiles_write_tile(outdb, z, tile.x, tile.y, compressed.data(), compressed.size());
+	kernels_for(child.detail).reduce_into(st->tl, child);
 
-	if (pthread_mutex_unlock(&db_lock) != 0) {
+	if (pthread_mutex_unlock(&st->lock) != 0) {
 		perror("pthread_mutex_unlock");
 		exit(EXIT_FAILURE);
 	}
 }
 
-void calc_tile_edges(size_t z, long long x, long long y, unsigned long long &start, unsigned long long &end) {
-	start = encode(x << (32 - z), y << (32 - z));
-	end = start;
+void reduce_tile(tiler *t, size_t z);
 
-	for (size_t i = 0; i < 32 - z; i++) {
-		end |= 3ULL << (2 * i);
-	}
-}
+// Make the tile at zoom z the one at tx/ty, finishing and reducing
+// whatever tile was being accumulated there before.
 
-void *run_tile(void *p) {
-	tiler *t = (tiler *) p;
+void activate_tile(tiler *t, size_t z, long long tx, long long ty) {
+	if (t->tiles[z].active && t->tiles[z].x == tx && t->tiles[z].y == ty) {
+		return;
+	}
 
-	if (t->start >= t->end) {
-		return NULL;
+	if (t->tiles[z].active) {
+		reduce_tile(t, z);
+		finish_tile(t, t->tiles[z]);
 	}
 
-	unsigned char firstbuf[RECORD_BYTES];
-	unsigned char lastbuf[RECORD_BYTES];
+	t->tiles[z].active = true;
+	t->tiles[z].x = tx;
+	t->tiles[z].y = ty;
+	t->tiles[z].clear();
+}
 
-	if (fseeko(t->fp, t->start * RECORD_BYTES + HEADER_LEN, SEEK_SET) != 0) {
-		perror("fseeko");
-		exit(EXIT_FAILURE);
-	}
-	if (fread(firstbuf, RECORD_BYTES, 1, t->fp) != 1) {
-		perror("fread");
-		exit(EXIT_FAILURE);
-	}
+// Add the counts from a completed tile at zoom z into its parent tile at
+// zoom z - 1. Because the input is in quadkey order, all four children of
+// a parent are completed in sequence before the parent itself is. Parents
+// below the split zoom are shared with other tasks instead.
 
-	if (fseeko(t->fp, (t->end - 1) * RECORD_BYTES + HEADER_LEN, SEEK_SET) != 0) {
-		perror("fseeko");
-		exit(EXIT_FAILURE);
+void reduce_tile(tiler *t, size_t z) {
+	if (z <= t->minzoom) {
+		return;
 	}
-	if (fread(lastbuf, RECORD_BYTES, 1, t->fp) != 1) {
-		perror("fread");
-		exit(EXIT_FAILURE);
+
+	tile &child = t->tiles[z];
+
+	if (z == t->state->splitzoom) {
+		reduce_shared(t, child);
+	} else {
+		activate_tile(t, z - 1, child.x >> 1, child.y >> 1);
+		kernels_for(child.detail).reduce_into(t->tiles[z - 1], child);
 	}
+}
 
-	unsigned long long first = read64(firstbuf);
-	unsigned long long last = read64(lastbuf);
+void update_progress(tiler *t, size_t n) {
+	tiling_state *state = t->state;
+	size_t done = state->done += n;
 
-	long long seq = 0;
-	long long percent = -1;
-	long long max = 0;
+	size_t percent = 100 * done / state->records;
+	if (percent != t->percent) {
+		t->percent = percent;
 
-	if (fseeko(t->fp, t->start * RECORD_BYTES + HEADER_LEN, SEEK_SET) != 0) {
-		perror("fseeko");
-		exit(EXIT_FAILURE);
+		if (!quiet) {
+			fprintf(stderr, "  %zu%%\r", (percent + 100 * t->step) / t->steps);
+		}
 	}
+}
 
-	unsigned long long oindex = 0;
-	for (size_t i = t->start; i < t->end; i++) {
-		unsigned char buf[RECORD_BYTES];
-		if (fread(buf, RECORD_BYTES, 1, t->fp) != 1) {
-			perror("fread");
-			exit(EXIT_FAILURE);
-		}
-		unsigned long long index = read64(buf);
-		unsigned long long count = read32(buf + INDEX_BYTES);
-		seq++;
+template <int DETAIL>
+void run_task(tiler *t, task const &tk) {
+	size_t detail = fixed_detail<DETAIL>(t->detail);
 
-		if (oindex > index) {
-			fprintf(stderr, "out of order: %llx vs %llx\n", oindex, index);
-		}
-		oindex = index;
+	// Only the tiles at the top zoom (normally maxzoom) are accumulated
+	// from the records. Lower zooms are built from them as they are completed.
+
+	size_t z = t->topzoom;
+	size_t seq = 0;
+
+	// The records are used where the scan leaves them, a span at a time
 
-		long long npercent = 100 * seq / (t->end - t->start);
-		if (npercent != percent) {
-			percent = npercent;
-			t->progress[t->shard] = percent;
+	record_scan scan;
+	scan_start(scan, t->input, tk.start, tk.end);
 
-			int sum = 0;
-			for (size_t j = 0; j < t->cpus; j++) {
-				sum += t->progress[j];
+	unsigned long long oindex = 0;
+	unsigned char *span;
+	for (size_t n; (n = scan_next(scan, &span)) > 0;) {
+		for (size_t i = 0; i < n; i++) {
+			unsigned char *buf = span + i * RECORD_BYTES;
+			unsigned long long index = read64(buf);
+			unsigned long long count = read32(buf + INDEX_BYTES);
+
+			if (oindex > index) {
+				fprintf(stderr, "out of order: %llx vs %llx\n", oindex, index);
 			}
-			sum /= t->cpus;
+			oindex = index;
 
-			if (!quiet) {
-				fprintf(stderr, "  %lu%%\r", sum / 2 + 50 * t->pass);
+			if (++seq >= 10000) {
+				update_progress(t, seq);
+				seq = 0;
 			}
-		}
 
-		unsigned wx, wy;
-		decode(index, &wx, &wy);
+			unsigned wx, wy;
+			decode(index, &wx, &wy);
 
-		if (wx < t->bbox[0]) {
-			t->bbox[0] = wx;
-		}
-		if (wy < t->bbox[1]) {
-			t->bbox[1] = wy;
-		}
-		if (wx > t->bbox[2]) {
-			t->bbox[2] = wx;
-		}
-		if (wy > t->bbox[3]) {
-			t->bbox[3] = wy;
-		}
+			if (wx < t->bbox[0]) {
+				t->bbox[0] = wx;
+			}
+			if (wy < t->bbox[1]) {
+				t->bbox[1] = wy;
+			}
+			if (wx > t->bbox[2]) {
+				t->bbox[2] = wx;
+			}
+			if (wy > t->bbox[3]) {
+				t->bbox[3] = wy;
+			}
 
-		for (size_t z = t->minzoom; z < t->zooms; z++) {
 			unsigned tx = wx, ty = wy;
-			if (z + t->detail != 32) {
-				tx >>= (32 - (z + t->detail));
-				ty >>= (32 - (z + t->detail));
+			if (z + detail != 32) {
+				tx >>= (32 - (z + detail));
+				ty >>= (32 - (z + detail));
 			}
 
 			unsigned px = tx, py = ty;
-			if (t->detail != 32) {
-				px &= ((1 << t->detail) - 1);
-				py &= ((1 << t->detail) - 1);
+			if (detail != 32) {
+				px &= ((1 << detail) - 1);
+				py &= ((1 << detail) - 1);
 
-				tx >>= t->detail;
-				ty >>= t->detail;
+				tx >>= detail;
+				ty >>= detail;
 			} else {
 				tx = 0;
 				ty = 0;
 			}
 
-			if (t->tiles[z].x != tx || t->tiles[z].y != ty) {
-				if (t->tiles[z].active) {
-					unsigned long long first_for_tile, last_for_tile;
-					calc_tile_edges(z, t->tiles[z].x, t->tiles[z].y, first_for_tile, last_for_tile);
+			activate_tile(t, z, tx, ty);
 
-					// printf("%zu/%lld/%lld: %llx (%llx %llx) %llx\n", z, t->tiles[z].x, t->tiles[z].y, first, first_for_tile, last_for_tile, last);
+			size_t pixel = t->tiles[z].index<DETAIL>(px, py);
+			t->tiles[z].add(pixel, count);
 
-					if (first_for_tile >= first && last_for_tile <= last) {
-						if (t->pass == 0) {
-							gather_quantile(t->tiles[z], t->detail, t->max[z]);
-						} else {
-							make_tile(t->outdb, t->tiles[z], z, t->detail, t->zoom_max[z], t->layername);
-						}
-					} else {
-						t->partial_tiles.push_back(t->tiles[z]);
-					}
-				}
+			// Ties go to the earliest location, so that the choice doesn't
+			// depend on which thread ran which task
+			long long here = t->tiles[z].get(pixel);
+			if (here > t->atmid || (here == t->atmid && index < t->atindex)) {
+				t->atmid = here;
+				t->atindex = index;
+				t->midx = wx;
+				t->midy = wy;
+			}
+		}
+	}
 
-				t->tiles[z].active = true;
-				t->tiles[z].x = tx;
-				t->tiles[z].y = ty;
+	scan_finish(scan);
+	update_progress(t, seq);
 
-				for (size_t x = 0; x < (1U << t->detail) * (1U << t->detail); x++) {
-					t->tiles[z].count[x] = 0;
-				}
-			}
+	// The task always ends at a tile boundary at the split zoom, so finish
+	// the tiles still in progress from the top down, so that each one has
+	// been reduced into its parent before the parent is finished.
+
+	for (ssize_t zz = t->topzoom; zz >= (ssize_t) t->state->splitzoom && zz >= (ssize_t) t->minzoom; zz--) {
+		if (t->tiles[zz].active) {
+			reduce_tile(t, zz);
+			finish_tile(t, t->tiles[zz]);
+			t->tiles[zz].active = false;
+		}
+	}
+}
 
-			t->tiles[z].count[py * (1 << t->detail) + px] += count;
+void let_go(tiling_state *state, kept_task &k) {
+	*state->budget += k.bytes;
+	k.bytes = 0;
+	k.kept = false;
+	std::vector<kept_tile>().swap(k.tiles);
+}
 
-			if (z == t->zooms - 1 && t->tiles[z].count[py * (1 << t->detail) + px] > max) {
-				max = t->tiles[z].count[py * (1 << t->detail) + px];
-				t->midx = wx;
-				t->midy = wy;
-				t->atmid = max;
+// Copy a tile completed on the first pass into the current task's kept
+// tiles, or give up on keeping the task if there isn't room for it
+
+void keep_tile(tiler *t, tile const &tl) {
+	kept_task &k = *t->keeping;
+	if (!k.kept) {
+		return;
+	}
+	if (*t->state->budget <= 0) {
+		let_go(t->state, k);
+		return;
+	}
+
+	kept_tile kt;
+	kt.x = tl.x;
+	kt.y = tl.y;
+	kt.z = tl.z;
+	if (tl.dense) {
+		for (size_t i = 0; i < tl.size(); i++) {
+			if (tl.get(i) != 0) {
+				kt.cells.push_back(i);
+				kt.raw.push_back(tl.get(i));
 			}
 		}
+	} else {
+		kt.cells = tl.touched;
+		kt.raw.resize(kt.cells.size());
+		for (size_t i = 0; i < kt.cells.size(); i++) {
+			kt.raw[i] = tl.get(kt.cells[i]);
+		}
+	}
+
+	long long bytes = sizeof(kept_tile) + kt.cells.size() * (sizeof(unsigned) + sizeof(long long));
+	k.bytes += bytes;
+	if ((*t->state->budget -= bytes) < 0) {
+		let_go(t->state, k);
+		return;
+	}
+
+	k.tiles.push_back(kept_tile());
+	k.tiles.back().x = kt.x;
+	k.tiles.back().y = kt.y;
+	k.tiles.back().z = kt.z;
+	k.tiles.back().cells.swap(kt.cells);
+	k.tiles.back().raw.swap(kt.raw);
+}
+
+// Instead of running a task again on the second pass, put its kept tiles
+// back together and encode them. The ones at the split zoom are reduced into
+// the shared tiles below them, as run_task() would have done.
+
+void replay_task(tiler *t, task const &tk, kept_task &k) {
+	for (size_t i = 0; i < k.tiles.size(); i++) {
+		kept_tile const &kt = k.tiles[i];
+		tile &tl = t->tiles[kt.z];
+
+		tl.clear();
+		tl.x = kt.x;
+		tl.y = kt.y;
+		for (size_t j = 0; j < kt.cells.size(); j++) {
+			tl.add(kt.cells[j], kt.raw[j]);
+		}
+
+		if ((size_t) kt.z == t->state->splitzoom && (size_t) kt.z > t->minzoom) {
+			reduce_shared(t, tl);
+		}
+		finish_tile(t, tl);
 	}
 
-	for (size_t z = t->minzoom; z < t->zooms; z++) {
-		if (t->tiles[z].active) {
-			unsigned long long first_for_tile, last_for_tile;
-			calc_tile_edges(z, t->tiles[z].x, t->tiles[z].y, first_for_tile, last_for_tile);
+	std::vector<kept_tile>().swap(k.tiles);
+	update_progress(t, tk.end - tk.start);
+}
 
-			// printf("%zu/%lld/%lld: %llx (%llx %llx) %llx\n", z, t->tiles[z].x, t->tiles[z].y, first, first_for_tile, last_for_tile, last);
+// Threads take the next task that nobody has started yet, until there are none left
 
-			if (first_for_tile >= first && last_for_tile <= last) {
-				if (t->pass == 0) {
-					gather_quantile(t->tiles[z], t->detail, t->max[z]);
-				} else {
-					make_tile(t->outdb, t->tiles[z], z, t->detail, t->zoom_max[z], t->layername);
-				}
-			} else {
-				t->partial_tiles.push_back(t->tiles[z]);
-			}
+void *run_tasks(void *p) {
+	tiler *t = (tiler *) p;
+	tiling_state *state = t->state;
+
+	while (true) {
+		size_t n = state->next++;
+		if (n >= state->tasks.size()) {
+			break;
+		}
+
+		if (state->kept != NULL && t->pass == 1 && (*state->kept)[n].kept) {
+			replay_task(t, state->tasks[n], (*state->kept)[n]);
+			continue;
+		}
+
+		if (state->kept != NULL && t->pass == 0) {
+			t->keeping = &(*state->kept)[n];
+		}
+		kernels_for(t->detail).run_task(t, state->tasks[n]);
+		t->keeping = NULL;
+	}
+
+	return NULL;
+}
+
+template <int DETAIL>
+void tile_pixels(tile const &t, std::vector<unsigned> &cells, std::vector<long long> &raw) {
+	t.nonzero<DETAIL>(cells);
+	t.values<DETAIL>(cells, raw);
+}
+
+template <int DETAIL>
+tile_kernels kernels_of() {
+	tile_kernels k;
+	k.run_task = run_task<DETAIL>;
+	k.reduce_into = reduce_into<DETAIL>;
+	k.pixels = tile_pixels<DETAIL>;
+
+	k.encode[OUTPUT_PNG] = encode_png<DETAIL>;
+	k.encode[OUTPUT_SINGLE] = encode_vector<DETAIL, OUTPUT_SINGLE>;
+	k.encode[OUTPUT_GROUPED] = encode_vector<DETAIL, OUTPUT_GROUPED>;
+
+	return k;
+}
+
+tile_kernels any_kernels;
+tile_kernels fixed_kernels[MAX_FIXED_DETAIL - MIN_FIXED_DETAIL + 1];
+
+// Set up the kernels for each detail at startup
+void make_kernels() {
+	any_kernels = kernels_of<ANY_DETAIL>();
+	fixed_kernels[7 - MIN_FIXED_DETAIL] = kernels_of<7>();
+	fixed_kernels[8 - MIN_FIXED_DETAIL] = kernels_of<8>();
+	fixed_kernels[9 - MIN_FIXED_DETAIL] = kernels_of<9>();
+	fixed_kernels[10 - MIN_FIXED_DETAIL] = kernels_of<10>();
+	fixed_kernels[11 - MIN_FIXED_DETAIL] = kernels_of<11>();
+	fixed_kernels[12 - MIN_FIXED_DETAIL] = kernels_of<12>();
+}
+
+tile_kernels const &kernels_for(size_t detail) {
+	if (detail >= MIN_FIXED_DETAIL && detail <= MAX_FIXED_DETAIL) {
+		return fixed_kernels[detail - MIN_FIXED_DETAIL];
+	}
+	return any_kernels;
+}
+
+// Once all the tasks are done, the shared tiles below the split zoom are
+// finished and reduced into the zoom below, in parallel, one zoom at a time.
+
+void *run_shared(void *p) {
+	tiler *t = (tiler *) p;
+	tiling_state *state = t->state;
+
+	while (true) {
+		size_t n = state->next++;
+		if (n >= state->level.size()) {
+			break;
+		}
+
+		shared_tile *st = state->level[n];
+		if ((size_t) st->tl.z > t->minzoom) {
+			reduce_shared(t, st->tl);
 		}
+		finish_tile(t, st->tl);
+		delete st;
 	}
 
 	return NULL;
 }
 
-void regress(std::vector<long long> &max, size_t minzoom) {
+// The largest counts are fitted as exponential in the zoom level. With a
+// detail schedule, what matters is the size of the pixels, so each zoom is
+// placed where the zoom with the same size pixels at the top detail would be.
+
+void regress(std::vector<long long> &max, size_t minzoom, std::vector<size_t> const &details) {
+	size_t top = details[max.size() - 1];
+
 	for (size_t i = minzoom; i < max.size(); i++) {
 		if (max[i] == 0) {
 			max[i] = 1;
@@ -572,7 +2354,7 @@ void regress(std::vector<long long> &max, size_t minzoom) {
 	size_t n = 0;
 
 	for (size_t i = minzoom; i < max.size(); i++) {
-		double x = i;
+		double x = i + ((double) details[i] - top);
 		double y = log(max[i]);
 
 		sum_x += x;
@@ -588,14 +2370,14 @@ void regress(std::vector<long long> &max, size_t minzoom) {
 	double b = (sum_y * sum_x2 - sum_x * sum_xy) / (n * sum_x2 - (sum_x * sum_x));
 
 	for (size_t i = minzoom; i < max.size(); i++) {
-		max[i] = exp(m * i + b);
+		max[i] = exp(m * (i + ((double) details[i] - top)) + b);
 		if (max[i] < 1) {
 			max[i] = 1;
 		}
 	}
 }
 
-void write_meta(std::vector<long long> const &zoom_max, sqlite3 *outdb) {
+void write_meta(output const &o, std::vector<long long> const &zoom_max, sqlite3 *outdb) {
 	char *sql, *err;
 
 	std::string maxes;
@@ -611,14 +2393,14 @@ void write_meta(std::vector<long long> const &zoom_max, sqlite3 *outdb) {
 	}
 	sqlite3_free(sql);
 
-	sql = sqlite3_mprintf("INSERT INTO metadata (name, value) VALUES ('density_levels', %d);", levels);
+	sql = sqlite3_mprintf("INSERT INTO metadata (name, value) VALUES ('density_levels', %d);", o.levels);
 	if (sqlite3_exec(outdb, sql, NULL, NULL, &err) != SQLITE_OK) {
 		fprintf(stderr, "set name in metadata: %s\n", err);
 		exit(EXIT_FAILURE);
 	}
 	sqlite3_free(sql);
 
-	sql = sqlite3_mprintf("INSERT INTO metadata (name, value) VALUES ('density_gamma', %f);", count_gamma);
+	sql = sqlite3_mprintf("INSERT INTO metadata (name, value) VALUES ('density_gamma', %f);", o.count_gamma);
 	if (sqlite3_exec(outdb, sql, NULL, NULL, &err) != SQLITE_OK) {
 		fprintf(stderr, "set name in metadata: %s\n", err);
 		exit(EXIT_FAILURE);
@@ -629,9 +2411,8 @@ void write_meta(std::vector<long long> const &zoom_max, sqlite3 *outdb) {
 struct tile_reader {
 	sqlite3 *db = NULL;
 	sqlite3_stmt *stmt = NULL;
-	sqlite3 *outdb = NULL;
+	size_t shard = 0;  // of the outputs
 	std::string name;
-	std::string layername;
 	std::string format;
 
 	int zoom = 0;
@@ -696,8 +2477,38 @@ void user_read_data(png_structp png_ptr, png_bytep data, png_size_t length) {
 	state->off += length;
 }
 
+// Add the count to each pixel from x0,y0 up to x1,y1 that is within the tile
+void add_pixels(tile &t, long long extent, long long x0, long long y0, long long x1, long long y1, long long count) {
+	x0 = std::max(x0, 0LL);
+	y0 = std::max(y0, 0LL);
+	x1 = std::min(x1, extent);
+	y1 = std::min(y1, extent);
+
+	for (long long y = y0; y < y1; y++) {
+		for (long long x = x0; x < x1; x++) {
+			t.add(t.index(x, y), count);
+		}
+	}
+}
+
+// The quantizer that goes back from the levels in a source tile to counts.
+// There are only as many as sources times zoom levels, so they are kept.
+quantizer const &source_quantizer(std::vector<quantizer> &sources, tile_reader const &r) {
+	long long zoom_max = r.max_density[r.zoom];
+
+	for (size_t i = 0; i < sources.size(); i++) {
+		if (sources[i].matches(r.density_levels, r.density_gamma, zoom_max)) {
+			return sources[i];
+		}
+	}
+
+	sources.push_back(quantizer(r.density_levels, r.density_gamma, zoom_max, 0));
+	return sources.back();
+}
+
 void *retile(void *v) {
 	std::vector<tile_reader *> *queue = (std::vector<tile_reader *> *) v;
+	std::vector<quantizer> sources;
 
 	tile t(0, 0);
 
@@ -738,25 +2549,23 @@ void *retile(void *v) {
 				exit(EXIT_FAILURE);
 			}
 
-			if (!t.active || t.z != (*queue)[i]->zoom || t.x != (*queue)[i]->x || t.y != (*queue)[i]->y() || t.count.size() != width * height) {
+			if (!t.active || t.z != (*queue)[i]->zoom || t.x != (*queue)[i]->x || t.y != (*queue)[i]->y() || t.size() != width * height) {
 				if (t.active) {
-					make_tile((*queue)[i]->outdb, t, t.z, log(sqrt(t.count.size())) / log(2), (*queue)[i]->global_density[t.z], (*queue)[i]->layername);
+					make_tiles((*queue)[i]->shard, t, t.detail, (*queue)[i]->global_density[t.z]);
 				}
 
 				t.active = true;
 				t.z = (*queue)[i]->zoom;
 				t.x = (*queue)[i]->x;
 				t.y = (*queue)[i]->y();
-				t.count.resize(width * height);
-
-				for (size_t j = 0; j < width * height; j++) {
-					t.count[j] = 0;
+				size_t dim = 0;
+				while ((1U << dim) < width) {
+					dim++;
 				}
+				t.resize(dim);
 			}
 
-			double gamma = (*queue)[i]->density_gamma;
-			long long zoom_max = (*queue)[i]->max_density[(*queue)[i]->zoom];
-			size_t density_levels = (*queue)[i]->density_levels;
+			quantizer const &q = source_quantizer(sources, *(*queue)[i]);
 
 			png_bytepp row_pointers = png_get_rows(png_ptr, info_ptr);
 			for (size_t y = 0; y < height; y++) {
@@ -764,16 +2573,15 @@ void *retile(void *v) {
 
 				for (size_t x = 0; x < width; x++) {
 					if (bytes[x] > 0) {
-						double bright = bytes[x];
-						long long count = ceil(exp(log(bright) * gamma) * zoom_max / exp(log(density_levels) * gamma));
+						long long count = q.count(bytes[x]);
 #if 0
-						int back = exp(log(exp(log(density_levels) * gamma) * count / zoom_max) / gamma);
+						int back = q.level(count);
 						if (back != bytes[x]) {
 							fprintf(stderr, "put in %d, got back %d (bitmap)\n", bytes[x], back);
 							exit(EXIT_FAILURE);
 						}
 #endif
-						t.count[width * y + x] += count;
+						t.add(t.index(x, y), count);
 					}
 				}
 			}
@@ -796,24 +2604,22 @@ void *retile(void *v) {
 				mvt_layer &layer = tile.layers[l];
 				size_t extent = layer.extent;
 
-				double gamma = (*queue)[i]->density_gamma;
-				long long zoom_max = (*queue)[i]->max_density[(*queue)[i]->zoom];
-				size_t density_levels = (*queue)[i]->density_levels;
+				quantizer const &q = source_quantizer(sources, *(*queue)[i]);
 
-				if (!t.active || t.z != (*queue)[i]->zoom || t.x != (*queue)[i]->x || t.y != (*queue)[i]->y() || t.count.size() != extent * extent) {
+				if (!t.active || t.z != (*queue)[i]->zoom || t.x != (*queue)[i]->x || t.y != (*queue)[i]->y() || t.size() != extent * extent) {
 					if (t.active) {
-						make_tile((*queue)[i]->outdb, t, t.z, log(sqrt(t.count.size())) / log(2), (*queue)[i]->global_density[t.z], (*queue)[i]->layername);
+						make_tiles((*queue)[i]->shard, t, t.detail, (*queue)[i]->global_density[t.z]);
 					}
 
 					t.active = true;
 					t.z = (*queue)[i]->zoom;
 					t.x = (*queue)[i]->x;
 					t.y = (*queue)[i]->y();
-					t.count.resize(extent * extent);
-
-					for (size_t j = 0; j < extent * extent; j++) {
-						t.count[j] = 0;
+					size_t dim = 0;
+					while ((1U << dim) < extent) {
+						dim++;
 					}
+					t.resize(dim);
 				}
 
 				for (size_t f = 0; f < layer.features.size(); f++) {
@@ -837,10 +2643,10 @@ void *retile(void *v) {
 						if (key == std::string("density")) {
 							if (val.type == mvt_uint) {
 								density = val.numeric_value.uint_value;
-								count = ceil(exp(log(density) * gamma) * zoom_max / exp(log(density_levels) * gamma));
+								count = q.count(val.numeric_value.uint_value);
 
 #if 0
-								int back = exp(log(exp(log(density_levels) * gamma) * count / zoom_max) / gamma);
+								int back = q.level(count);
 								if (back != val.numeric_value.uint_value) {
 									fprintf(stderr, "put in %llu, got back %d (vector)\n", val.numeric_value.uint_value, back);
 									exit(EXIT_FAILURE);
@@ -860,15 +2666,28 @@ void *retile(void *v) {
 						exit(EXIT_FAILURE);
 					}
 
-					for (size_t g = 0; g < feat.geometry.size(); g++) {
-						// XXX This thinks it knows that the moveto is always the top left of the pixel
+					if (feat.type == mvt_point) {
+						for (size_t g = 0; g < feat.geometry.size(); g++) {
+							if (feat.geometry[g].op == mvt_moveto) {
+								add_pixels(t, extent, feat.geometry[g].x, feat.geometry[g].y, feat.geometry[g].x + 1, feat.geometry[g].y + 1, count);
+							}
+						}
+					} else {
+						// Each ring is a rectangle of pixels, one pixel unless they were merged
+						for (size_t g = 0; g < feat.geometry.size(); g++) {
+							if (feat.geometry[g].op == mvt_moveto) {
+								long long x0 = feat.geometry[g].x, y0 = feat.geometry[g].y;
+								long long x1 = x0, y1 = y0;
+
+								for (g++; g < feat.geometry.size() && feat.geometry[g].op == mvt_lineto; g++) {
+									x0 = std::min(x0, (long long) feat.geometry[g].x);
+									y0 = std::min(y0, (long long) feat.geometry[g].y);
+									x1 = std::max(x1, (long long) feat.geometry[g].x);
+									y1 = std::max(y1, (long long) feat.geometry[g].y);
+								}
+								g--;
 
-						if (feat.geometry[g].op == mvt_moveto) {
-							if (feat.geometry[g].x >= 0 &&
-							    feat.geometry[g].y >= 0 &&
-							    feat.geometry[g].x < (ssize_t) extent &&
-							    feat.geometry[g].y < (ssize_t) extent) {
-								t.count[extent * feat.geometry[g].y + feat.geometry[g].x] += count;
+								add_pixels(t, extent, x0, y0, x1, y1, count);
 							}
 						}
 					}
@@ -878,7 +2697,7 @@ void *retile(void *v) {
 	}
 
 	if (t.active) {
-		make_tile((*queue)[0]->outdb, t, t.z, log(sqrt(t.count.size())) / log(2), (*queue)[0]->global_density[t.z], (*queue)[0]->layername);
+		make_tiles((*queue)[0]->shard, t, t.detail, (*queue)[0]->global_density[t.z]);
 	}
 
 	return NULL;
@@ -891,6 +2710,7 @@ void merge(std::vector<tile_reader> &r, size_t cpus) {
 	size_t o = 0;
 	for (size_t i = 0; i < r.size(); i++) {
 		queues[o].push_back(&r[i]);
+		r[i].shard = o;
 
 		if (i + 1 < r.size() && (r[i].x != r[i + 1].x || r[i].y() != r[i + 1].y() || r[i].zoom != r[i + 1].zoom)) {
 			o = (o + 1) % cpus;
@@ -933,7 +2753,7 @@ std::vector<long long> parse_max_density(const unsigned char *v) {
 	return out;
 }
 
-void merge_tiles(char **fnames, size_t n, size_t cpus, sqlite3 *outdb, int zooms, std::vector<long long> &zoom_max, double &midlat, double &midlon, double &minlat, double &minlon, double &maxlat, double &maxlon, std::string const &layername) {
+void merge_tiles(char **fnames, size_t n, size_t cpus, int zooms, std::vector<long long> &zoom_max, double &midlat, double &midlon, double &minlat, double &minlon, double &maxlat, double &maxlon) {
 	std::vector<tile_reader> readers;
 	size_t total_rows = 0;
 	size_t seq = 0;
@@ -943,7 +2763,6 @@ void merge_tiles(char **fnames, size_t n, size_t cpus, sqlite3 *outdb, int zooms
 	for (size_t i = 0; i < n; i++) {
 		tile_reader r;
 		r.name = fnames[i];
-		r.outdb = outdb;
 
 		if (sqlite3_open(fnames[i], &r.db) != SQLITE_OK) {
 			fprintf(stderr, "%s: %s\n", fnames[i], sqlite3_errmsg(r.db));
@@ -1001,7 +2820,8 @@ void merge_tiles(char **fnames, size_t n, size_t cpus, sqlite3 *outdb, int zooms
 			sqlite3_finalize(stmt);
 		}
 
-		if (sqlite3_prepare_v2(r.db, "SELECT max(rowid) from tiles;", -1, &stmt, NULL) == SQLITE_OK) {
+		// Not max(rowid), since tiles may be a view
+		if (sqlite3_prepare_v2(r.db, "SELECT count(*) from tiles;", -1, &stmt, NULL) == SQLITE_OK) {
 			if (sqlite3_step(stmt) == SQLITE_ROW) {
 				total_rows += sqlite3_column_int(stmt, 0);
 			}
@@ -1018,7 +2838,6 @@ void merge_tiles(char **fnames, size_t n, size_t cpus, sqlite3 *outdb, int zooms
 			r.zoom = sqlite3_column_int(r.stmt, 0);
 			r.x = sqlite3_column_int(r.stmt, 1);
 			r.sorty = sqlite3_column_int(r.stmt, 2);
-			r.layername = layername;
 
 			const char *data = (const char *) sqlite3_column_blob(r.stmt, 3);
 			size_t len = sqlite3_column_bytes(r.stmt, 3);
@@ -1079,6 +2898,8 @@ void merge_tiles(char **fnames, size_t n, size_t cpus, sqlite3 *outdb, int zooms
 		}
 	}
 
+	make_quantizers(zoom_max);
+
 	std::priority_queue<tile_reader> reader_q;
 	for (size_t i = 0; i < readers.size(); i++) {
 		readers[i].global_density = zoom_max;
@@ -1105,7 +2926,6 @@ void merge_tiles(char **fnames, size_t n, size_t cpus, sqlite3 *outdb, int zooms
 			r.zoom = sqlite3_column_int(r.stmt, 0);
 			r.x = sqlite3_column_int(r.stmt, 1);
 			r.sorty = sqlite3_column_int(r.stmt, 2);
-			r.layername = layername;
 
 			const char *data = (const char *) sqlite3_column_blob(r.stmt, 3);
 			size_t len = sqlite3_column_bytes(r.stmt, 3);
@@ -1139,22 +2959,433 @@ void merge_tiles(char **fnames, size_t n, size_t cpus, sqlite3 *outdb, int zooms
 	merge(to_merge, cpus);
 }
 
+void run_threads(std::vector<tiler> &tilers, void *(*func)(void *)) {
+	pthread_t pthreads[tilers.size()];
+
+	for (size_t j = 0; j < tilers.size(); j++) {
+		if (pthread_create(&pthreads[j], NULL, func, &tilers[j]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (size_t j = 0; j < tilers.size(); j++) {
+		void *retval;
+
+		if (pthread_join(pthreads[j], &retval) != 0) {
+			perror("pthread_join");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// A byte count, optionally followed by K, M, or G
+unsigned long long parse_size(const char *s) {
+	char *end;
+	double size = strtod(s, &end);
+
+	if (*end == 'k' || *end == 'K') {
+		size *= 1024;
+		end++;
+	} else if (*end == 'm' || *end == 'M') {
+		size *= 1024 * 1024;
+		end++;
+	} else if (*end == 'g' || *end == 'G') {
+		size *= 1024 * 1024 * 1024;
+		end++;
+	}
+
+	if (*end != '\0' || size < 1) {
+		return 0;
+	}
+
+	return size;
+}
+
+// A detail for a range of zoom levels
+struct detail_range {
+	size_t detail;
+	int minzoom;
+	int maxzoom;
+};
+
+// -d is either one detail for every zoom level, or a list of details for
+// ranges of zoom levels, like 7@0-5,9@6-14. A range can also be a single
+// zoom level, like 8@3, or have no end, like 9@6-.
+std::vector<detail_range> parse_details(const char *s, char **argv) {
+	std::vector<detail_range> ranges;
+	const char *cp = s;
+
+	while (true) {
+		detail_range r;
+		char *end;
+		bool ok = true;
+
+		r.detail = strtoul(cp, &end, 10);
+		ok = ok && end != cp && *cp >= '0' && *cp <= '9';
+		cp = end;
+		r.minzoom = 0;
+		r.maxzoom = INT_MAX;
+
+		if (ok && *cp == '@') {
+			cp++;
+			r.minzoom = r.maxzoom = strtol(cp, &end, 10);
+			ok = ok && end != cp && *cp >= '0' && *cp <= '9';
+			cp = end;
+
+			if (ok && *cp == '-') {
+				cp++;
+				if (*cp >= '0' && *cp <= '9') {
+					r.maxzoom = strtol(cp, &end, 10);
+					cp = end;
+				} else {
+					r.maxzoom = INT_MAX;
+				}
+			}
+		}
+
+		if (!ok || r.maxzoom < r.minzoom || (*cp != ',' && *cp != '\0')) {
+			fprintf(stderr, "%s: Can't understand detail -d%s: must be a detail or a list like 7@0-5,9@6-14\n", argv[0], s);
+			exit(EXIT_FAILURE);
+		}
+		ranges.push_back(r);
+
+		if (*cp == '\0') {
+			break;
+		}
+		cp++;
+	}
+
+	return ranges;
+}
+
+// The detail for the highest zoom level in the ranges, which is the one
+// that the bin size goes with
+size_t top_detail(std::vector<detail_range> const &ranges) {
+	size_t top = 0;
+	for (size_t i = 1; i < ranges.size(); i++) {
+		if (ranges[i].maxzoom >= ranges[top].maxzoom) {
+			top = i;
+		}
+	}
+	return ranges[top].detail;
+}
+
+// The detail for each zoom level. If more than one range covers a zoom,
+// the last one listed is used. Each zoom's tiles are made from the ones
+// above it, so their pixels can't be smaller than the ones they are made from.
+std::vector<size_t> zoom_details(std::vector<detail_range> const &ranges, size_t zooms, size_t minzoom, char **argv) {
+	std::vector<size_t> details(zooms, 0);
+	std::vector<bool> set(zooms, false);
+
+	for (size_t i = 0; i < ranges.size(); i++) {
+		for (long long z = ranges[i].minzoom; z <= ranges[i].maxzoom && z < (long long) zooms; z++) {
+			details[z] = ranges[i].detail;
+			set[z] = true;
+		}
+	}
+
+	for (size_t z = minzoom; z < zooms; z++) {
+		if (!set[z]) {
+			fprintf(stderr, "%s: No detail (-d) for zoom level %zu\n", argv[0], z);
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (size_t z = minzoom; z < zooms; z++) {
+		if (z + 1 < zooms && details[z] > details[z + 1] + 1) {
+			fprintf(stderr, "%s: Detail %zu for zoom level %zu is finer than zoom level %zu can be made from (at most %zu)\n", argv[0], details[z], z, z + 1, details[z + 1] + 1);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Nothing is tiled below minzoom
+	for (size_t z = 0; z < minzoom && z < zooms; z++) {
+		details[z] = details[minzoom];
+	}
+
+	return details;
+}
+
+// Work out how many zoom levels each thread can accumulate at once within
+// the memory limit, allowing 4 bytes per pixel for each zoom level being
+// accumulated, plus the tiles below the split zoom, fewer than two zoom
+// levels' worth of which are ever in memory at once, each with fewer tiles
+// than there are tasks. Each encoding thread needs another 24 bytes per
+// pixel for encoding a tile, plus its spare tiles. If the limit is too small
+// for even one zoom level per thread, use fewer threads.
+size_t plan_memory(unsigned long long memory_limit, size_t detail, size_t &cpus, size_t &encode_threads, size_t zooms) {
+	unsigned long long pixels = (1ULL << detail) * (1ULL << detail);
+	unsigned long long per_zoom = 4 * pixels;
+	unsigned long long per_thread = 2 * TASKS_PER_CPU * per_zoom;
+	unsigned long long per_encoder = 24 * pixels + SPARES_PER_ENCODER * per_zoom;
+
+	while (encode_threads > 1 && memory_limit / 2 < encode_threads * per_encoder) {
+		encode_threads--;
+	}
+
+	unsigned long long encoding = encode_threads * per_encoder;
+	unsigned long long left = 0;
+	if (memory_limit > encoding) {
+		left = memory_limit - encoding;
+	}
+
+	while (cpus > 1 && left / cpus < per_thread + per_zoom) {
+		cpus--;
+	}
+
+	if (left / cpus < per_thread + per_zoom) {
+		fprintf(stderr, "Warning: memory limit is too small for -d%zu; using it anyway\n", detail);
+		return 1;
+	}
+
+	size_t group = (left / cpus - per_thread) / per_zoom;
+	if (group > zooms) {
+		group = zooms;
+	}
+
+	return group;
+}
+
+// The options that can be different for each output, as they appear in an --output
+#define OUTPUT_OPTIONS "l:m:M:g:bwc:n:y:1kKP"
+
+static struct option output_long_options[] = {
+	{"format", required_argument, 0, 0},
+	{"dedup", no_argument, 0, 0},
+	{"adaptive", no_argument, 0, 0},
+	{0, 0, 0, 0},
+};
+
+// Set one of the options for an output. name is the long option, for opt 0.
+// Returns false if it isn't one of the options that are set for each output.
+bool output_option(output &o, int opt, const char *name, const char *arg, char **argv) {
+	switch (opt) {
+	case 0:
+		if (strcmp(name, "format") == 0) {
+			o.format = arg;
+		} else if (strcmp(name, "dedup") == 0) {
+			o.dedup = true;
+		} else if (strcmp(name, "adaptive") == 0) {
+			o.adaptive = true;
+		} else {
+			return false;
+		}
+		break;
+
+	case 'k':
+		o.limit_tile_sizes = false;
+		break;
+
+	case 'K':
+		o.increment_threshold = true;
+		break;
+
+	case 'l':
+		o.levels = atoi(arg);
+		if (o.levels < 1 || o.levels > 256) {
+			fprintf(stderr, "%s: Levels (-l%s) cannot exceed 256\n", argv[0], arg);
+			exit(EXIT_FAILURE);
+		}
+		break;
+
+	case 'n':
+		o.layername = arg;
+		break;
+
+	case 'm':
+		o.first_level = atoi(arg);
+		break;
+
+	case 'M':
+		o.first_count = atoi(arg);
+		break;
+
+	case 'y':
+		if (strcmp(arg, "count") == 0) {
+			o.include_count = true;
+		} else if (strcmp(arg, "density") == 0) {
+			o.include_density = true;
+		} else {
+			fprintf(stderr, "Unknown attribute: -y %s\n", arg);
+			exit(EXIT_FAILURE);
+		}
+		break;
+
+	case 'g':
+		o.count_gamma = atof(arg);
+		break;
+
+	case 'b':
+		o.bitmap = true;
+		break;
+
+	case 'c':
+		o.color = strtoul(arg, NULL, 16);
+		break;
+
+	case 'P':
+		o.points = true;
+		break;
+
+	case 'w':
+		o.white = 1;
+		break;
+
+	case '1':
+		o.single_polygons = true;
+		break;
+
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+// An --output is the name of the output, followed by its own options,
+// separated by spaces. Options that aren't given have their defaults,
+// not the ones for -o.
+output *parse_output(const char *spec, char **argv) {
+	output *o = new output;
+
+	std::vector<char *> args;
+	args.push_back(argv[0]);
+	char *words = strdup(spec);
+	for (char *tok = strtok(words, " \t"); tok != NULL; tok = strtok(NULL, " \t")) {
+		args.push_back(tok);
+	}
+	if (args.size() < 2) {
+		fprintf(stderr, "%s: --output needs the name of the output\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	o->outfile = args[1];
+	args.erase(args.begin() + 1);
+	int n = args.size();
+	args.push_back(NULL);
+
+	optind = 0;  // start over, with these arguments
+	int i;
+	int option_index = 0;
+	while ((i = getopt_long(n, args.data(), OUTPUT_OPTIONS, output_long_options, &option_index)) != -1) {
+		if (!output_option(*o, i, output_long_options[option_index].name, optarg, argv)) {
+			fprintf(stderr, "%s: Can't use that option in --output %s\n", argv[0], spec);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (optind < n) {
+		fprintf(stderr, "%s: Unexpected %s in --output %s\n", argv[0], args[optind], spec);
+		exit(EXIT_FAILURE);
+	}
+
+	return o;
+}
+
+// Check the options for an output, and work out what follows from them
+void finish_output(output &o, char **argv) {
+	if (!(o.include_count || o.include_density)) {
+		o.include_density = true;
+	}
+
+	if (o.adaptive && (o.bitmap || o.single_polygons || o.points)) {
+		fprintf(stderr, "%s: --adaptive chooses between points and polygons grouped by level, so can't be used with -b, -1, or -P\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (o.bitmap) {
+		o.mode = OUTPUT_PNG;
+		make_palette(o);
+	} else if (o.single_polygons) {
+		o.mode = OUTPUT_SINGLE;
+	} else {
+		o.mode = OUTPUT_GROUPED;
+	}
+}
+
 int main(int argc, char **argv) {
 	extern int optind;
 	extern char *optarg;
 
-	char *outfile = NULL;
 	int minzoom = 0;
 	int maxzoom = -1;
 	int bin = -1;
 	bool force = false;
-	size_t detail = 9;
+	std::vector<detail_range> detail_ranges = parse_details("9", argv);
 	size_t cpus = sysconf(_SC_NPROCESSORS_ONLN);
-	std::string layername = "count";
+	unsigned long long memory_limit = 0;
+	unsigned long long retain = 0;
+	size_t encode_threads = 0;
+	bool ordered = false;
+	size_t shards = 0;
+	std::vector<const char *> output_specs;
+
+	output *primary = new output;
+	outputs.push_back(primary);
+
+	static struct option long_options[] = {
+		{"memory-limit", required_argument, 0, 0},
+		{"retain", required_argument, 0, 0},
+		{"encode-threads", required_argument, 0, 0},
+		{"ordered", no_argument, 0, 0},
+		{"shards", required_argument, 0, 0},
+		{"format", required_argument, 0, 0},
+		{"dedup", no_argument, 0, 0},
+			{"compression", required_argument, 0, 0},
+		{"adaptive", no_argument, 0, 0},
+		{"output", required_argument, 0, 0},
+		{0, 0, 0, 0},
+	};
 
 	int i;
-	while ((i = getopt(argc, argv, "fz:Z:s:a:o:p:d:l:m:M:g:bwc:qn:y:1kKP")) != -1) {
+	int option_index = 0;
+	while ((i = getopt_long(argc, argv, "fz:Z:s:a:o:p:d:l:m:M:g:bwc:qn:y:1kKP", long_options, &option_index)) != -1) {
 		switch (i) {
+		case 0:
+			if (strcmp(long_options[option_index].name, "memory-limit") == 0) {
+				memory_limit = parse_size(optarg);
+				if (memory_limit == 0) {
+					fprintf(stderr, "%s: Can't understand memory limit --memory-limit=%s\n", argv[0], optarg);
+					exit(EXIT_FAILURE);
+				}
+			} else if (strcmp(long_options[option_index].name, "retain") == 0) {
+				retain = parse_size(optarg);
+				if (retain == 0) {
+					fprintf(stderr, "%s: Can't understand size to retain --retain=%s\n", argv[0], optarg);
+					exit(EXIT_FAILURE);
+				}
+			} else if (strcmp(long_options[option_index].name, "encode-threads") == 0) {
+				encode_threads = atoi(optarg);
+				if (encode_threads < 1) {
+					fprintf(stderr, "%s: Must have at least one encoding thread: --encode-threads=%s\n", argv[0], optarg);
+					exit(EXIT_FAILURE);
+				}
+			} else if (strcmp(long_options[option_index].name, "ordered") == 0) {
+				ordered = true;
+			} else if (strcmp(long_options[option_index].name, "shards") == 0) {
+				shards = atoi(optarg);
+				if (shards < 1) {
+					fprintf(stderr, "%s: Must have at least one shard: --shards=%s\n", argv[0], optarg);
+					exit(EXIT_FAILURE);
+				}
+			} else if (strcmp(long_options[option_index].name, "output") == 0) {
+				output_specs.push_back(optarg);
+			} else if (strcmp(long_options[option_index].name, "compression") == 0) {
+				if (strcmp(optarg, "store") == 0) {
+					compression_level = 0;
+				} else if (strcmp(optarg, "fast") == 0) {
+					compression_level = 1;
+				} else if (strcmp(optarg, "max") == 0) {
+					compression_level = 9;
+				} else if (optarg[0] >= '0' && optarg[0] <= '9' && optarg[1] == '\0') {
+					compression_level = atoi(optarg);
+				} else {
+					fprintf(stderr, "%s: Unknown --compression %s: must be store, fast, max, or 0 to 9\n", argv[0], optarg);
+					exit(EXIT_FAILURE);
+				}
+			} else {
+				output_option(*primary, i, long_options[option_index].name, optarg, argv);
+			}
+			break;
+
 		case 'f':
 			force = true;
 			break;
@@ -1176,88 +3407,26 @@ int main(int argc, char **argv) {
 			break;
 
 		case 'd':
-			detail = atoi(optarg);
+			detail_ranges = parse_details(optarg, argv);
 			break;
 
 		case 'q':
 			quiet = true;
 			break;
 
-		case 'k':
-			limit_tile_sizes = false;
-			break;
-
-		case 'K':
-			increment_threshold = true;
-			break;
-
-		case 'l':
-			levels = atoi(optarg);
-			if (levels < 1 || levels > 256) {
-				fprintf(stderr, "%s: Levels (-l%s) cannot exceed 256\n", argv[0], optarg);
-				exit(EXIT_FAILURE);
-			}
-			break;
-
-		case 'n':
-			layername = optarg;
-			break;
-
-		case 'm':
-			first_level = atoi(optarg);
-			break;
-
-		case 'M':
-			first_count = atoi(optarg);
-			break;
-
-		case 'y':
-			if (strcmp(optarg, "count") == 0) {
-				include_count = true;
-			} else if (strcmp(optarg, "density") == 0) {
-				include_density = true;
-			} else {
-				fprintf(stderr, "Unknown attribute: -y %s\n", optarg);
-				exit(EXIT_FAILURE);
-			}
-
-			break;
-
-		case 'g':
-			count_gamma = atof(optarg);
-			break;
-
-		case 'b':
-			bitmap = 1;
-			break;
-
-		case 'c':
-			color = strtoul(optarg, NULL, 16);
-			break;
-
-		case 'P':
-			points = true;
-			break;
-
-		case 'w':
-			white = 1;
-			break;
-
 		case 'o':
-			outfile = optarg;
-			break;
-
-		case '1':
-			single_polygons = true;
+			primary->outfile = optarg;
 			break;
 
 		default:
-			usage(argv);
-			exit(EXIT_FAILURE);
+			if (!output_option(*primary, i, NULL, optarg, argv)) {
+				usage(argv);
+				exit(EXIT_FAILURE);
+			}
 		}
 	}
 
-	if (outfile == NULL) {
+	if (primary->outfile == NULL) {
 		fprintf(stderr, "%s: must specify -o output.mbtiles\n", argv[0]);
 		usage(argv);
 		exit(EXIT_FAILURE);
@@ -1269,14 +3438,51 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
-	if (!(include_count || include_density)) {
-		include_density = true;
+	// The inputs are after the options, so the --outputs are parsed
+	// once getopt is done with the command line
+
+	int first_input = optind;
+	for (size_t j = 0; j < output_specs.size(); j++) {
+		outputs.push_back(parse_output(output_specs[j], argv));
+	}
+	optind = first_input;
+
+	for (size_t j = 0; j < outputs.size(); j++) {
+		for (size_t k = 0; k < j; k++) {
+			if (strcmp(outputs[j]->outfile, outputs[k]->outfile) == 0) {
+				fprintf(stderr, "%s: %s is the name of more than one output\n", argv[0], outputs[j]->outfile);
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		finish_output(*outputs[j], argv);
+	}
+	make_kernels();
+
+	if (encode_threads == 0) {
+		encode_threads = cpus;
 	}
 
-	if (force) {
-		unlink(outfile);
+	// Each writer thread gets a part of the output of its own to write to.
+
+	for (size_t j = 0; j < outputs.size(); j++) {
+		output &o = *outputs[j];
+		o.sink = open_sink(o.format, o.outfile, argv, force, o.dedup);
+
+		size_t n = shards;
+		if (n == 0) {
+			n = o.sink->default_writers(encode_threads);
+		}
+		if (n > o.sink->max_writers()) {
+			fprintf(stderr, "%s: Warning: only %zu shard%s possible for %s output; using %zu\n", argv[0], o.sink->max_writers(), o.sink->max_writers() == 1 ? " is" : "s are", o.format, o.sink->max_writers());
+			n = o.sink->max_writers();
+		}
+
+		for (size_t k = 0; k < n; k++) {
+			o.writers.push_back(new tile_writer);
+			writer_start(o.writers[k], o.sink->writer(k, n), ordered, o.dedup);
+		}
 	}
-	sqlite3 *outdb = mbtiles_open(outfile, argv, false);
 
 	double minlat = 90, minlon = 180, maxlat = -90, maxlon = -180, midlat = 0, midlon = 0;
 	std::vector<long long> zoom_max;
@@ -1301,7 +3507,7 @@ int main(int argc, char **argv) {
 	}
 
 	if (zooms == 0) {
-		if (optind + 1 != argc || (maxzoom < 0 && bin < 0) || outfile == NULL) {
+		if (optind + 1 != argc || (maxzoom < 0 && bin < 0)) {
 			usage(argv);
 		}
 
@@ -1310,6 +3516,7 @@ int main(int argc, char **argv) {
 			exit(EXIT_FAILURE);
 		}
 
+		size_t detail = top_detail(detail_ranges);
 		if (maxzoom >= 0) {
 			zooms = maxzoom + 1;
 		} else {
@@ -1321,190 +3528,241 @@ int main(int argc, char **argv) {
 			zooms = bin - detail + 1;
 		}
 
-		struct stat st;
-		if (stat(argv[optind], &st) != 0) {
-			perror(optind[argv]);
+		if (minzoom >= (int) zooms) {
+			fprintf(stderr, "%s: Minzoom (%d) is greater than maxzoom (%zu)\n", argv[0], minzoom, zooms - 1);
 			exit(EXIT_FAILURE);
 		}
 
-		FILE *fps[cpus];
-		for (size_t j = 0; j < cpus; j++) {
-			fps[j] = fopen(argv[optind], "rb");
-			if (fps[j] == NULL) {
-				perror(argv[optind]);
-				exit(EXIT_FAILURE);
-			}
-		}
+		std::vector<size_t> details = zoom_details(detail_ranges, zooms, minzoom, argv);
+		detail = *std::max_element(details.begin() + minzoom, details.end());
+
+		// All the threads share one mapping of the input
+
+		record_file *input = open_records(argv[optind], HEADER_LEN, RECORD_BYTES);
 
-		char buf[HEADER_LEN];
-		if (fread(buf, HEADER_LEN, 1, fps[0]) != 1) {
-			perror("fread file header");
+		unsigned char buf[HEADER_LEN];
+		if (input->size < HEADER_LEN) {
+			fprintf(stderr, "%s: not a tile-count file\n", argv[optind]);
 			exit(EXIT_FAILURE);
 		}
+		read_bytes(input, 0, HEADER_LEN, buf);
 		if (memcmp(buf, header_text, HEADER_LEN) != 0) {
 			fprintf(stderr, "%s: not a tile-count file\n", argv[optind]);
 			exit(EXIT_FAILURE);
 		}
 
-		for (size_t pass = 0; pass < 2; pass++) {
-			volatile int progress[cpus];
-			std::vector<tiler> tilers;
-			tilers.resize(cpus);
+		// With a memory limit, each pass over the input only accumulates
+		// as many zoom levels as fit in memory at once, starting from maxzoom.
 
-			for (size_t j = 0; j < cpus; j++) {
-				for (size_t z = 0; z < zooms; z++) {
-					tilers[j].tiles.push_back(tile(detail, z));
-					tilers[j].max.push_back(0);
-				}
-				tilers[j].bbox[0] = tilers[j].bbox[1] = UINT_MAX;
-				tilers[j].bbox[2] = tilers[j].bbox[3] = 0;
-				tilers[j].midx = tilers[j].midy = 0;
-				tilers[j].zooms = zooms;
-				tilers[j].minzoom = minzoom;
-				tilers[j].detail = detail;
-				tilers[j].outdb = outdb;
-				tilers[j].progress = progress;
-				tilers[j].progress[j] = 0;
-				tilers[j].cpus = cpus;
-				tilers[j].shard = j;
-				tilers[j].maxzoom = zooms - 1;
-				tilers[j].pass = pass;
-				tilers[j].zoom_max = zoom_max;
-				tilers[j].layername = layername;
-			}
-
-			size_t records = (st.st_size - HEADER_LEN) / RECORD_BYTES;
-			for (size_t j = 0; j < cpus; j++) {
-				tilers[j].fp = fps[j];
-				tilers[j].start = j * records / cpus;
-				if (j > 0) {
-					tilers[j - 1].end = tilers[j].start;
-				}
-			}
-			tilers[cpus - 1].end = records;
+		size_t group = zooms - minzoom;
+		if (memory_limit != 0) {
+			group = plan_memory(memory_limit, detail, cpus, encode_threads, zooms - minzoom);
 
-			pthread_t pthreads[cpus];
-			for (size_t j = 0; j < cpus; j++) {
-				if (pthread_create(&pthreads[j], NULL, run_tile, &tilers[j]) != 0) {
-					perror("pthread_create");
-					exit(EXIT_FAILURE);
-				}
+			if (!quiet) {
+				fprintf(stderr, "Tiling %zu zoom level%s per pass with %zu thread%s and %zu encoding thread%s\n", group, group == 1 ? "" : "s", cpus, cpus == 1 ? "" : "s", encode_threads, encode_threads == 1 ? "" : "s");
 			}
+		}
+		size_t groups = (zooms - minzoom + group - 1) / group;
+		std::vector<long long> pass_max;
+		pass_max.resize(zooms, 0);
+
+		size_t records = count_records(input);
+		std::vector<std::vector<task>> group_tasks;
+		std::vector<size_t> group_split;
+		group_tasks.resize(groups);
+		group_split.resize(groups);
+
+		// With --retain, the tiles completed on the first pass are kept for
+		// the second, for as many tasks as fit, instead of being built again
+		std::vector<std::vector<kept_task>> group_kept;
+		std::atomic<long long> budget(retain > LLONG_MAX ? LLONG_MAX : retain);
+		group_kept.resize(groups);
 
-			for (size_t j = 0; j < cpus; j++) {
-				void *retval;
+		for (size_t pass = 0; pass < 2; pass++) {
+			encoder_pool encoders;
+			if (pass == 1) {
+				encoder_start(&encoders, encode_threads, zoom_max);
+			}
 
-				if (pthread_join(pthreads[j], &retval) != 0) {
-					perror("pthread_join");
-					exit(EXIT_FAILURE);
+			for (size_t g = 0; g < groups; g++) {
+				size_t topzoom = zooms - 1 - g * group;
+				size_t lowzoom = minzoom;
+				if (topzoom + 1 - minzoom > group) {
+					lowzoom = topzoom + 1 - group;
 				}
-			}
 
-			// Collect and consolidate partially counted tiles
+				if (pass == 0) {
+					plan_tasks(input, records, lowzoom, topzoom, cpus, group_split[g], group_tasks[g]);
+
+					if (retain != 0) {
+						kept_task k;
+						k.kept = true;
+						k.bytes = 0;
+						group_kept[g].resize(group_tasks[g].size(), k);
+					}
+				}
 
-			std::map<std::vector<unsigned>, tile> partials;
-			for (size_t j = 0; j < cpus; j++) {
-				for (size_t k = 0; k < tilers[j].partial_tiles.size(); k++) {
-					std::vector<unsigned> key;
-					key.push_back(tilers[j].partial_tiles[k].z);
-					key.push_back(tilers[j].partial_tiles[k].x);
-					key.push_back(tilers[j].partial_tiles[k].y);
+				tiling_state state;
+				state.tasks = group_tasks[g];
+				state.splitzoom = group_split[g];
+				state.records = records;
+				state.details = details;
+				state.kept = retain != 0 ? &group_kept[g] : NULL;
+				state.budget = &budget;
+				state.shared.resize(zooms);
 
-					auto a = partials.find(key);
+				std::vector<tiler> tilers;
+				tilers.resize(cpus);
 
-					if (a == partials.end()) {
-						partials.insert(std::pair<std::vector<unsigned>, tile>(key, tilers[j].partial_tiles[k]));
-					} else {
-						for (size_t x = 0; x < (1U << detail) * (1U << detail); x++) {
-							a->second.count[x] += tilers[j].partial_tiles[k].count[x];
+				for (size_t j = 0; j < cpus; j++) {
+					for (size_t z = 0; z < zooms; z++) {
+						if (z >= lowzoom && z >= state.splitzoom && z <= topzoom) {
+							tilers[j].tiles.push_back(tile(details[z], z, true));
+						} else {
+							tilers[j].tiles.push_back(tile(0, z, true));
 						}
+						tilers[j].max.push_back(0);
 					}
+					tilers[j].bbox[0] = tilers[j].bbox[1] = UINT_MAX;
+					tilers[j].bbox[2] = tilers[j].bbox[3] = 0;
+					tilers[j].midx = tilers[j].midy = 0;
+					tilers[j].atmid = 0;
+					tilers[j].atindex = 0;
+					tilers[j].input = input;
+					tilers[j].zooms = zooms;
+					tilers[j].minzoom = lowzoom;
+					tilers[j].topzoom = topzoom;
+					tilers[j].detail = details[topzoom];
+					tilers[j].encoders = &encoders;
+					tilers[j].keeping = NULL;
+					tilers[j].state = &state;
+					tilers[j].percent = 999;
+					tilers[j].maxzoom = zooms - 1;
+					tilers[j].pass = pass;
+					tilers[j].step = pass * groups + g;
+					tilers[j].steps = 2 * groups;
 				}
-			}
 
-			for (auto a = partials.begin(); a != partials.end(); a++) {
-				if (pass == 0) {
-					gather_quantile(a->second, detail, tilers[0].max[a->second.z]);
-				} else {
-					make_tile(outdb, a->second, a->second.z, detail, zoom_max[a->second.z], layername);
-				}
-			}
+				run_threads(tilers, run_tasks);
 
-			if (pass == 0) {
-				for (size_t z = 0; z < zooms; z++) {
-					long long max = 0;
+				// Then finish the tiles below the split zoom, from the top down
 
-					for (size_t c = 0; c < tilers.size(); c++) {
-						if (tilers[c].max[z] / 2 > max) {
-							max = tilers[c].max[z] / 2;
-						}
+				for (ssize_t z = (ssize_t) state.splitzoom - 1; z >= (ssize_t) lowzoom; z--) {
+					state.level.clear();
+					for (auto a = state.shared[z].begin(); a != state.shared[z].end(); a++) {
+						state.level.push_back(a->second);
 					}
+					state.shared[z].clear();
+					state.next = 0;
 
-					zoom_max.push_back(max);
+					run_threads(tilers, run_shared);
 				}
 
-				regress(zoom_max, minzoom);
-			} else {
-				long long file_bbox[4] = {UINT_MAX, UINT_MAX, 0, 0};
-				for (size_t j = 0; j < cpus; j++) {
-					if (tilers[j].bbox[0] < file_bbox[0]) {
-						file_bbox[0] = tilers[j].bbox[0];
-					}
-					if (tilers[j].bbox[1] < file_bbox[1]) {
-						file_bbox[1] = tilers[j].bbox[1];
+				if (pass == 0) {
+					for (size_t z = 0; z < zooms; z++) {
+						for (size_t c = 0; c < tilers.size(); c++) {
+							if (tilers[c].max[z] > pass_max[z]) {
+								pass_max[z] = tilers[c].max[z];
+							}
+						}
 					}
-					if (tilers[j].bbox[2] > file_bbox[2]) {
-						file_bbox[2] = tilers[j].bbox[2];
+				}
+
+				// Only the first pass is sure to have read every record,
+				// since the second may have kept tiles instead
+
+				if (pass == 0 && topzoom == zooms - 1) {
+					long long file_bbox[4] = {UINT_MAX, UINT_MAX, 0, 0};
+					for (size_t j = 0; j < cpus; j++) {
+						if (tilers[j].bbox[0] < file_bbox[0]) {
+							file_bbox[0] = tilers[j].bbox[0];
+						}
+						if (tilers[j].bbox[1] < file_bbox[1]) {
+							file_bbox[1] = tilers[j].bbox[1];
+						}
+						if (tilers[j].bbox[2] > file_bbox[2]) {
+							file_bbox[2] = tilers[j].bbox[2];
+						}
+						if (tilers[j].bbox[3] > file_bbox[3]) {
+							file_bbox[3] = tilers[j].bbox[3];
+						}
 					}
-					if (tilers[j].bbox[3] > file_bbox[3]) {
-						file_bbox[3] = tilers[j].bbox[3];
+
+					long long max = 0;
+					unsigned long long atindex = 0;
+					for (size_t j = 0; j < cpus; j++) {
+						if (tilers[j].atmid > max || (tilers[j].atmid == max && max != 0 && tilers[j].atindex < atindex)) {
+							max = tilers[j].atmid;
+							atindex = tilers[j].atindex;
+							tile2lonlat(tilers[j].midx, tilers[j].midy, 32, &midlon, &midlat);
+						}
 					}
+
+					tile2lonlat(file_bbox[0], file_bbox[1], 32, &minlon, &maxlat);
+					tile2lonlat(file_bbox[2], file_bbox[3], 32, &maxlon, &minlat);
 				}
+			}
 
-				long long max = 0;
-				for (size_t j = 0; j < cpus; j++) {
-					if (tilers[j].atmid > max) {
-						max = tilers[j].atmid;
-						tile2lonlat(tilers[j].midx, tilers[j].midy, 32, &midlon, &midlat);
-					}
+			if (pass == 0) {
+				for (size_t z = 0; z < zooms; z++) {
+					zoom_max.push_back(pass_max[z] / 2);
 				}
 
-				tile2lonlat(file_bbox[0], file_bbox[1], 32, &minlon, &maxlat);
-				tile2lonlat(file_bbox[2], file_bbox[3], 32, &maxlon, &minlat);
+				regress(zoom_max, minzoom, details);
+				make_quantizers(zoom_max);
+			} else {
+				encoder_finish(&encoders);
 			}
 		}
+
+		close_records(input);
 	} else {
 		fprintf(stderr, "going to merge %zu zoom levels\n", zooms);
-		merge_tiles(argv + optind, argc - optind, cpus, outdb, zooms, zoom_max, midlat, midlon, minlat, minlon, maxlat, maxlon, layername);
+		merge_tiles(argv + optind, argc - optind, cpus, zooms, zoom_max, midlat, midlon, minlat, minlon, maxlat, maxlon);
 	}
 
-	layermap_entry lme(0);
+	for (size_t j = 0; j < outputs.size(); j++) {
+		output &o = *outputs[j];
 
-	if (include_count) {
-		type_and_string tas;
-		tas.type = mvt_double;
-		tas.string = "count";
-		lme.file_keys.insert(tas);
-	}
+		for (size_t k = 0; k < o.writers.size(); k++) {
+			writer_finish(o.writers[k]);
+			delete o.writers[k];
+		}
 
-	if (include_density) {
-		type_and_string tas2;
-		tas2.type = mvt_double;
-		tas2.string = "density";
-		lme.file_keys.insert(tas2);
-	}
+		layermap_entry lme(0);
 
-	lme.minzoom = 0;
-	lme.maxzoom = zooms - 1;
+		if (o.include_count) {
+			type_and_string tas;
+			tas.type = mvt_double;
+			tas.string = "count";
+			lme.file_keys.insert(tas);
+		}
 
-	std::map<std::string, layermap_entry> lm;
-	if (!bitmap) {
-		lm.insert(std::pair<std::string, layermap_entry>(layername, lme));
-	}
+		if (o.include_density) {
+			type_and_string tas2;
+			tas2.type = mvt_double;
+			tas2.string = "density";
+			lme.file_keys.insert(tas2);
+		}
 
-	mbtiles_write_metadata(outdb, outfile, 0, zooms - 1, minlat, minlon, maxlat, maxlon, midlat, midlon, false, "", lm, !bitmap);
+		lme.minzoom = 0;
+		lme.maxzoom = zooms - 1;
 
-	write_meta(zoom_max, outdb);
+		std::map<std::string, layermap_entry> lm;
+		if (!o.bitmap) {
+			lm.insert(std::pair<std::string, layermap_entry>(o.layername, lme));
+		}
+
+		// The metadata is put together in a scratch database and copied from
+		// there to the output, whatever kind of output it is.
 
-	mbtiles_close(outdb, argv);
+		sqlite3 *metadb = mbtiles_open((char *) ":memory:", argv, false, true, false);
+		mbtiles_write_metadata(metadb, o.outfile, 0, zooms - 1, minlat, minlon, maxlat, maxlon, midlat, midlon, false, "", lm, !o.bitmap);
+		write_meta(o, zoom_max, metadb);
+		o.sink->write_metadata(read_metadata(metadb));
+		sqlite3_close(metadb);
+
+		o.sink->close();
+		delete o.sink;
+	}
 }
@@ -14,7 +14,14 @@
 #include "mvt.hpp"
 #include "mbtiles.hpp"
 
-sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
+// In bulk-load mode, the tiles table has no index until mbtiles_close(),
+// so inserts only append to it, and the index is built once at the end.
+//
+// With dedup, tiles are split into a map from tile to image ID and a table
+// of images by ID, so identical tiles are only stored once, and tiles is a
+// view joining them.
+
+sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable, bool bulk, bool dedup) {
 	sqlite3 *outdb;
 
 	if (sqlite3_open(dbname, &outdb) != SQLITE_OK) {
@@ -35,16 +42,51 @@ sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
 		fprintf(stderr, "%s: async: %s\n", argv[0], err);
 		exit(EXIT_FAILURE);
 	}
+	if (bulk) {
+		// Room to sort for the index. The page size is left alone,
+		// since bigger pages make small tilesets much bigger.
+		if (sqlite3_exec(outdb, "PRAGMA cache_size=-65536", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: cache size: %s\n", argv[0], err);
+			exit(EXIT_FAILURE);
+		}
+	}
 	if (sqlite3_exec(outdb, "CREATE TABLE metadata (name text, value text);", NULL, NULL, &err) != SQLITE_OK) {
 		fprintf(stderr, "%s: create metadata table: %s\n", argv[0], err);
 		if (!forcetable) {
 			exit(EXIT_FAILURE);
 		}
 	}
-	if (sqlite3_exec(outdb, "CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: create tiles table: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_FAILURE);
+	if (dedup) {
+		if (sqlite3_exec(outdb, "CREATE TABLE map (zoom_level integer, tile_column integer, tile_row integer, tile_id text);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create map table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (sqlite3_exec(outdb, "CREATE TABLE images (tile_data blob, tile_id text);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create images table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (sqlite3_exec(outdb, "create unique index images_id on images (tile_id);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index images: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (sqlite3_exec(outdb, "CREATE VIEW tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id;", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create tiles view: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
+		}
+	} else {
+		if (sqlite3_exec(outdb, "CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: create tiles table: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
 		}
 	}
 	if (sqlite3_exec(outdb, "create unique index name on metadata (name);", NULL, NULL, &err) != SQLITE_OK) {
@@ -53,17 +95,25 @@ sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
 			exit(EXIT_FAILURE);
 		}
 	}
-	if (sqlite3_exec(outdb, "create unique index tile_index on tiles (zoom_level, tile_column, tile_row);", NULL, NULL, &err) != SQLITE_OK) {
-		fprintf(stderr, "%s: index tiles: %s\n", argv[0], err);
-		if (!forcetable) {
-			exit(EXIT_FAILURE);
+	if (!bulk) {
+		const char *sql = "create unique index tile_index on tiles (zoom_level, tile_column, tile_row);";
+		if (dedup) {
+			sql = "create unique index map_index on map (zoom_level, tile_column, tile_row);";
+		}
+
+		if (sqlite3_exec(outdb, sql, NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: index tiles: %s\n", argv[0], err);
+			if (!forcetable) {
+				exit(EXIT_FAILURE);
+			}
 		}
 	}
 
 	return outdb;
 }
 
-void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data, int size) {
+// The statement for writing tiles, to be used for all of them
+sqlite3_stmt *mbtiles_prepare_write(sqlite3 *outdb) {
 	sqlite3_stmt *stmt;
 	const char *query = "insert into tiles (zoom_level, tile_column, tile_row, tile_data) values (?, ?, ?, ?)";
 	if (sqlite3_prepare_v2(outdb, query, -1, &stmt, NULL) != SQLITE_OK) {
@@ -71,17 +121,74 @@ void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data,
 		exit(EXIT_FAILURE);
 	}
 
+	return stmt;
+}
+
+// The data only needs to stay around until this returns
+void mbtiles_write_tile(sqlite3_stmt *stmt, sqlite3 *outdb, int z, int tx, int ty, const char *data, int size) {
 	sqlite3_bind_int(stmt, 1, z);
 	sqlite3_bind_int(stmt, 2, tx);
 	sqlite3_bind_int(stmt, 3, (1 << z) - 1 - ty);
-	sqlite3_bind_blob(stmt, 4, data, size, NULL);
+	sqlite3_bind_blob(stmt, 4, data, size, SQLITE_STATIC);
 
 	if (sqlite3_step(stmt) != SQLITE_DONE) {
 		fprintf(stderr, "sqlite3 insert failed: %s\n", sqlite3_errmsg(outdb));
 	}
-	if (sqlite3_finalize(stmt) != SQLITE_OK) {
-		fprintf(stderr, "sqlite3 finalize failed: %s\n", sqlite3_errmsg(outdb));
+	if (sqlite3_reset(stmt) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 reset failed: %s\n", sqlite3_errmsg(outdb));
+	}
+	sqlite3_clear_bindings(stmt);
+}
+
+// For databases opened with dedup, the statements for the map and images
+sqlite3_stmt *mbtiles_prepare_map(sqlite3 *outdb) {
+	sqlite3_stmt *stmt;
+	const char *query = "insert into map (zoom_level, tile_column, tile_row, tile_id) values (?, ?, ?, ?)";
+	if (sqlite3_prepare_v2(outdb, query, -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 map insert prep failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return stmt;
+}
+
+sqlite3_stmt *mbtiles_prepare_image(sqlite3 *outdb) {
+	sqlite3_stmt *stmt;
+	const char *query = "insert into images (tile_data, tile_id) values (?, ?)";
+	if (sqlite3_prepare_v2(outdb, query, -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 images insert prep failed\n");
+		exit(EXIT_FAILURE);
 	}
+
+	return stmt;
+}
+
+void mbtiles_write_map(sqlite3_stmt *stmt, sqlite3 *outdb, int z, int tx, int ty, std::string const &id) {
+	sqlite3_bind_int(stmt, 1, z);
+	sqlite3_bind_int(stmt, 2, tx);
+	sqlite3_bind_int(stmt, 3, (1 << z) - 1 - ty);
+	sqlite3_bind_text(stmt, 4, id.data(), id.size(), SQLITE_STATIC);
+
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		fprintf(stderr, "sqlite3 map insert failed: %s\n", sqlite3_errmsg(outdb));
+	}
+	if (sqlite3_reset(stmt) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 reset failed: %s\n", sqlite3_errmsg(outdb));
+	}
+	sqlite3_clear_bindings(stmt);
+}
+
+void mbtiles_write_image(sqlite3_stmt *stmt, sqlite3 *outdb, std::string const &id, const char *data, int size) {
+	sqlite3_bind_blob(stmt, 1, data, size, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, id.data(), id.size(), SQLITE_STATIC);
+
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		fprintf(stderr, "sqlite3 images insert failed: %s\n", sqlite3_errmsg(outdb));
+	}
+	if (sqlite3_reset(stmt) != SQLITE_OK) {
+		fprintf(stderr, "sqlite3 reset failed: %s\n", sqlite3_errmsg(outdb));
+	}
+	sqlite3_clear_bindings(stmt);
 }
 
 static void quote(std::string *buf, const char *s) {
@@ -286,9 +393,108 @@ void mbtiles_write_metadata(sqlite3 *outdb, const char *fname, int minzoom, int
 	}
 }
 
+// Copy the tiles from the shard databases into the output, in index order.
+// With dedup, images that are in more than one shard are only copied once.
+
+void mbtiles_merge_shards(sqlite3 *outdb, std::vector<std::string> const &shards, char **argv, bool dedup) {
+	char *err;
+	std::string select;
+	std::string images;
+
+	for (size_t i = 0; i < shards.size(); i++) {
+		char *sql = sqlite3_mprintf("ATTACH DATABASE %Q AS shard%d;", shards[i].c_str(), (int) i);
+		if (sqlite3_exec(outdb, sql, NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: attach %s: %s\n", argv[0], shards[i].c_str(), err);
+			exit(EXIT_FAILURE);
+		}
+		sqlite3_free(sql);
+
+		if (i != 0) {
+			select += " UNION ALL ";
+			images += " UNION ALL ";
+		}
+		if (dedup) {
+			aprintf(&select, "SELECT zoom_level, tile_column, tile_row, tile_id FROM shard%zu.map", i);
+			aprintf(&images, "SELECT tile_data, tile_id FROM shard%zu.images", i);
+		} else {
+			aprintf(&select, "SELECT zoom_level, tile_column, tile_row, tile_data FROM shard%zu.tiles", i);
+		}
+	}
+
+	std::string sql = "INSERT INTO tiles (zoom_level, tile_column, tile_row, tile_data) SELECT * FROM (" + select + ") ORDER BY zoom_level, tile_column, tile_row;";
+	if (dedup) {
+		sql = "INSERT INTO map (zoom_level, tile_column, tile_row, tile_id) SELECT * FROM (" + select + ") ORDER BY zoom_level, tile_column, tile_row;";
+	}
+	if (sqlite3_exec(outdb, sql.c_str(), NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "%s: merge shards: %s\n", argv[0], err);
+		exit(EXIT_FAILURE);
+	}
+
+	if (dedup) {
+		sql = "INSERT OR IGNORE INTO images (tile_data, tile_id) SELECT * FROM (" + images + ") ORDER BY tile_id;";
+		if (sqlite3_exec(outdb, sql.c_str(), NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: merge shard images: %s\n", argv[0], err);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (size_t i = 0; i < shards.size(); i++) {
+		std::string detach;
+		aprintf(&detach, "DETACH DATABASE shard%zu;", i);
+		if (sqlite3_exec(outdb, detach.c_str(), NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "%s: detach %s: %s\n", argv[0], shards[i].c_str(), err);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// Report one of the tiles that was written more than once
+static void report_duplicate(sqlite3 *outdb, char **argv) {
+	sqlite3_stmt *stmt;
+	const char *query = "SELECT zoom_level, tile_column, tile_row, count(*) from tiles group by zoom_level, tile_column, tile_row having count(*) > 1 limit 1;";
+
+	if (sqlite3_prepare_v2(outdb, query, -1, &stmt, NULL) == SQLITE_OK) {
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			int z = sqlite3_column_int(stmt, 0);
+			int x = sqlite3_column_int(stmt, 1);
+			int y = (1 << z) - 1 - sqlite3_column_int(stmt, 2);
+
+			fprintf(stderr, "%s: tile %d/%d/%d was written %d times\n", argv[0], z, x, y, sqlite3_column_int(stmt, 3));
+		}
+		sqlite3_finalize(stmt);
+	}
+}
+
+static bool has_table(sqlite3 *outdb, const char *name) {
+	sqlite3_stmt *stmt;
+	bool found = false;
+
+	if (sqlite3_prepare_v2(outdb, "SELECT name from sqlite_master where type = 'table' and name = ?;", -1, &stmt, NULL) == SQLITE_OK) {
+		sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+		if (sqlite3_step(stmt) == SQLITE_ROW) {
+			found = true;
+		}
+		sqlite3_finalize(stmt);
+	}
+
+	return found;
+}
+
 void mbtiles_close(sqlite3 *outdb, char **argv) {
 	char *err;
 
+	// Does nothing unless the database was opened for bulk loading
+	const char *sql = "create unique index if not exists tile_index on tiles (zoom_level, tile_column, tile_row);";
+	if (has_table(outdb, "map")) {
+		sql = "create unique index if not exists map_index on map (zoom_level, tile_column, tile_row);";
+	}
+
+	if (sqlite3_exec(outdb, sql, NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "%s: index tiles: %s\n", argv[0], err);
+		report_duplicate(outdb, argv);
+		exit(EXIT_FAILURE);
+	}
+
 	if (sqlite3_exec(outdb, "ANALYZE;", NULL, NULL, &err) != SQLITE_OK) {
 		fprintf(stderr, "%s: ANALYZE failed: %s\n", argv[0], err);
 		exit(EXIT_FAILURE);
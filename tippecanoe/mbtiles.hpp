@@ -16,12 +16,24 @@ struct layermap_entry {
 	}
 };
 
-sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable);
+sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable, bool bulk, bool dedup);
 
-void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data, int size);
+sqlite3_stmt *mbtiles_prepare_write(sqlite3 *outdb);
+
+void mbtiles_write_tile(sqlite3_stmt *stmt, sqlite3 *outdb, int z, int tx, int ty, const char *data, int size);
+
+sqlite3_stmt *mbtiles_prepare_map(sqlite3 *outdb);
+
+sqlite3_stmt *mbtiles_prepare_image(sqlite3 *outdb);
+
+void mbtiles_write_map(sqlite3_stmt *stmt, sqlite3 *outdb, int z, int tx, int ty, std::string const &id);
+
+void mbtiles_write_image(sqlite3_stmt *stmt, sqlite3 *outdb, std::string const &id, const char *data, int size);
 
 void mbtiles_write_metadata(sqlite3 *outdb, const char *fname, int minzoom, int maxzoom, double minlat, double minlon, double maxlat, double maxlon, double midlat, double midlon, int forcetable, const char *attribution, std::map<std::string, layermap_entry> const &layermap, bool vector);
 
+void mbtiles_merge_shards(sqlite3 *outdb, std::vector<std::string> const &shards, char **argv, bool dedup);
+
 void mbtiles_close(sqlite3 *outdb, char **argv);
 
 void aprintf(std::string *buf, const char *format, ...);